@@ -70,8 +70,6 @@ foreach (@ARGV) {
 
 usage() if (not defined $offloaddir);
 
-opendir(DIRH, $offloaddir) || die("Couldn't open directory [$offloaddir]: $!");
-
 my $diskrecovered = 0;
 my $headrequests = 0;
 my $filesseen = 0;
@@ -87,112 +85,152 @@ if (defined $youngerthan) {
     print("Checking all files.\n");
 }
 
-while (my $f = readdir(DIRH)) {
-    # '7' is the file size info in stat().
-    # '9' is the mtime info in stat().
-    my $filespace = 0;
-
-    $filesseen++;
-
-    if ($f =~ /\Adebug-/) {
-        print(" - Deleting debug file '$f'.\n");
-        my @statbuf = (stat($f));
-        my $size = 0;
-        $size = $statbuf[7] if @statbuf;
-        $diskrecovered += $size;
-        $totalfilespace += $size;
-        $filesdelete++;
-        unlink("$offloaddir/$f");
-    }
+# each of GORIGINS gets its own subdirectory, even without the daemon.
+sub cleanupDir {
+    my ($dir, $depth) = @_;
+    my $dirh;
+    opendir($dirh, $dir) || die("Couldn't open directory [$dir]: $!");
+
+    while (my $f = readdir($dirh)) {
+        next if ($f =~ /\A\./);
+        if (-d "$dir/$f") {
+            cleanupDir("$dir/$f", $depth + 1) if ($depth == 0);
+            next;
+        }
 
-    next if (not $f =~ /\A(meta|file)data-/);
-    my ($filetype, $etag) = ($f =~ /\A(meta|file)data-(.*)\Z/);
-    my $metadatapath = $offloaddir . '/metadata-' . $etag;
-    my $filedatapath = $offloaddir . '/filedata-' . $etag;
+        # '7' is the file size info in stat().
+        # '9' is the mtime info in stat().
+        my $filespace = 0;
+
+        $filesseen++;
+
+        if ($f =~ /\Adebug-/) {
+            print(" - Deleting debug file '$f'.\n");
+            my @statbuf = (stat($f));
+            my $size = 0;
+            $size = $statbuf[7] if @statbuf;
+            $diskrecovered += $size;
+            $totalfilespace += $size;
+            $filesdelete++;
+            unlink("$dir/$f");
+        }
 
-    my $filecachesize = (stat($filedatapath))[7];
+        # skip updateUrlIndex()'s temp files (".tmpPID"); they're mid-write.
+        if (($f =~ /\Aurlindex-/) && (not $f =~ /\./)) {
+            # these point at a cache entry; drop them once it's gone.
+            my $target = undef;
+            if (open(IDXH, '<', "$dir/$f")) {
+                $target = <IDXH>;
+                close(IDXH);
+            }
+            if ((not defined $target) || (not -f "$dir/metadata-$target")) {
+                $filesdelete++;
+                unlink("$dir/$f");
+            }
+            next;
+        }
 
-    my @metastat = stat($metadatapath);
-    my $filecachemtime = $metastat[9];
+        if ($f =~ /\Aprefetching-(.*)\Z/) {
+            # offload servers remove these when a prefetch finishes, unless
+            #  they crashed in the middle of it.
+            if (not -f "$dir/metadata-$1") {
+                $filesdelete++;
+                unlink("$dir/$f");
+            }
+            next;
+        }
 
-    $filespace += $metastat[7] if (-f $metadatapath);
-    $filespace += $filecachesize if (-f $filedatapath);
+        next if (not $f =~ /\A(meta|file)data-/);
+        my ($filetype, $etag) = ($f =~ /\A(meta|file)data-(.*)\Z/);
+        my $metadatapath = $dir . '/metadata-' . $etag;
+        my $filedatapath = $dir . '/filedata-' . $etag;
 
-    $totalfilespace += $filespace;
+        my $filecachesize = (stat($filedatapath))[7];
 
-    if ((not -f $filedatapath) || (not -f $metadatapath)) {
-        unlink $metadatapath;
-        unlink $filedatapath;
-        $filesdelete++;
-        $diskrecovered += $filespace;
-        next;
-    }
+        my @metastat = stat($metadatapath);
+        my $filecachemtime = $metastat[9];
 
-    next if ($filetype eq 'file');
-    next if ((defined $youngerthan) && ((time()-$metastat[9]) > $youngerthan));
-
-    my %metadata = loadMetadata($metadatapath);
-    next if (not %metadata);
-
-    my $tmp = $metadata{'ETag'};
-    $tmp = '"BOGUSSTRING"' if (not defined $tmp);
-    $tmp =~ s/\A\"(.*?)\"\Z/$1/;
-    if ($tmp ne $etag) {
-        print("File '$metadatapath' is bogus.\n");
-        $diskrecovered += $filespace;
-        unlink $metadatapath;
-        unlink $filedatapath;
-        $filesdelete++;
-        next;
-    }
+        $filespace += $metastat[7] if (-f $metadatapath);
+        $filespace += $filecachesize if (-f $filedatapath);
 
-    my $len = $metadata{'Content-Length'};
-    my $hostname = $metadata{'X-Offload-Hostname'};
-    my $origurl = $metadata{'X-Offload-Orig-URL'};
-    my $url = 'http://' . $hostname . $origurl;
+        $totalfilespace += $filespace;
 
-    if ($outputurls) {
-        print "$url\n";
-        next;
-    }
+        if ((not -f $filedatapath) || (not -f $metadatapath)) {
+            unlink $metadatapath;
+            unlink $filedatapath;
+            $filesdelete++;
+            $diskrecovered += $filespace;
+            next;
+        }
 
-    $headrequests++;
-    my $request = HTTP::Request->new(HEAD => $url);
-    my $response = $ua->request($request);
-
-    print(" - $url ($etag) ... ");
-
-    my $dokill = 0;
-    my $httpcode = $response->code();
-    if ($httpcode == 404) {
-        print("is no longer on base server.");
-        $dokill = 1;
-    } elsif ($response->is_error()) {
-        # everything else we ignore for now.
-        print("status unknown (HTTP error $httpcode).");
-    } elsif (($nukeshortfiles) && ($len != $filecachesize)) {
-        $dokill = 1;
-        print("Cached file is wrong size.");
-    } else {
-        my $hetag = $response->header('ETag');
-        $hetag = '' if (not defined $hetag);
-        $dokill = 1 if ($hetag ne "\"$etag\"");
-        # !!! FIXME: check other attributes...
-        print("out of date in some way.") if ($dokill);
-    }
+        next if ($filetype eq 'file');
+        next if ((defined $youngerthan) && ((time()-$metastat[9]) > $youngerthan));
+
+        my %metadata = loadMetadata($metadatapath);
+        next if (not %metadata);
+
+        my $tmp = $metadata{'ETag'};
+        $tmp = '"BOGUSSTRING"' if (not defined $tmp);
+        $tmp =~ s/\A\"(.*?)\"\Z/$1/;
+        if ($tmp ne $etag) {
+            print("File '$metadatapath' is bogus.\n");
+            $diskrecovered += $filespace;
+            unlink $metadatapath;
+            unlink $filedatapath;
+            $filesdelete++;
+            next;
+        }
+
+        my $len = $metadata{'Content-Length'};
+        my $hostname = $metadata{'X-Offload-Hostname'};
+        my $origurl = $metadata{'X-Offload-Orig-URL'};
+        my $url = 'http://' . $hostname . $origurl;
+
+        if ($outputurls) {
+            print "$url\n";
+            next;
+        }
+
+        $headrequests++;
+        my $request = HTTP::Request->new(HEAD => $url);
+        my $response = $ua->request($request);
 
-    if ($dokill) {
-        print("  DELETE!\n");
-        $diskrecovered += $filespace;
-        unlink $metadatapath;
-        unlink $filedatapath;
-        $filesdelete++;
-    } else {
-        print("KEEP!\n");
+        print(" - $url ($etag) ... ");
+
+        my $dokill = 0;
+        my $httpcode = $response->code();
+        if ($httpcode == 404) {
+            print("is no longer on base server.");
+            $dokill = 1;
+        } elsif ($response->is_error()) {
+            # everything else we ignore for now.
+            print("status unknown (HTTP error $httpcode).");
+        } elsif (($nukeshortfiles) && ($len != $filecachesize)) {
+            $dokill = 1;
+            print("Cached file is wrong size.");
+        } else {
+            my $hetag = $response->header('ETag');
+            $hetag = '' if (not defined $hetag);
+            $dokill = 1 if ($hetag ne "\"$etag\"");
+            # !!! FIXME: check other attributes...
+            print("out of date in some way.") if ($dokill);
+        }
+
+        if ($dokill) {
+            print("  DELETE!\n");
+            $diskrecovered += $filespace;
+            unlink $metadatapath;
+            unlink $filedatapath;
+            $filesdelete++;
+        } else {
+            print("KEEP!\n");
+        }
     }
+
+    closedir($dirh);
 }
 
-closedir(DIRH);
+cleanupDir($offloaddir, 0);
 
 if (not $outputurls) {
     print("Recovered $diskrecovered bytes of $totalfilespace.\n");
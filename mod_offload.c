@@ -13,7 +13,7 @@
  *  servers). icculus.org uses this to spread the bandwidth around.
  *
  * To Build/Install as a shared module:
- *  /where/i/installed/apache/bin/apxs -c -i -a mod_offload.c
+ *  /where/i/installed/apache/bin/apxs -c -i -a mod_offload.c -lm
  *
  * Make sure this is in your Apache config:
  *   LoadModule offload_module     libexec/mod_offload.so
@@ -36,12 +36,53 @@
  *    If not enabled, this module will just pass requests through to the
  *    next Apache handler untouched.
  *
- *  OffloadHost <hostname>
+ *  OffloadHost <hostname> [weight]
  *    ...An offload host. You need at least one specified for offloading
  *    to function. You can specify this directive multiple times to add
  *    more offload servers. These can be IP addresses or FQDN's...this
  *    module will try to do a DNS lookup at startup if necessary, and will
- *    fail if it can't.
+ *    fail if it can't. Requests from any address the host resolves to (all
+ *    its A and AAAA records) are treated as the offload server filling its
+ *    cache. Put IPv6 addresses in brackets ("[2001:db8::1]:8080"). The
+ *    optional weight (a whole number, default 1) is how big a share of the
+ *    traffic this host gets compared to the others, in every OffloadBalance
+ *    mode: a host with weight 10 gets about ten times as many clients as
+ *    one with weight 1, so give your bigger machines bigger weights.
+ *
+ *  OffloadBalance <Time|Hash|Load>
+ *    ...how to pick an offload server for a given request. "Time" rotates
+ *    through the OffloadHost list once per second, so everything requested
+ *    in the same second goes to the same server. "Hash" uses consistent
+ *    (rendezvous) hashing on the URI, so each file is mostly sent to the
+ *    same server, and each server caches a distinct slice of your content
+ *    instead of all of them caching everything. Adding or removing a host
+ *    only moves about 1/N of the files to a different server. "Load" sends
+ *    each client to the less busy of two randomly-picked servers, going by
+ *    the active connections and bandwidth each one reports to our health
+ *    checks (so OffloadHealthCheck must point at nph-offload's status page,
+ *    GSTATUSURI, and this server must be in its GSTATUSALLOW list). Until
+ *    every host has reported its load, "Load" acts like "Time". Defaults to
+ *    Time.
+ *
+ *  OffloadHealthCheck <uri>
+ *    ...check on every OffloadHost in the background by sending it an HTTP
+ *    HEAD request for <uri> (something small, like the offload server's
+ *    status page, or "/robots.txt"). Hosts that fail enough checks in a row
+ *    stop getting redirects until a check succeeds again. If every host is
+ *    down, requests are served by this server as if mod_offload wasn't
+ *    installed. Host state lives in shared memory, so all Apache children
+ *    agree on it and only one of them probes each host per interval. This
+ *    directive is server-wide (put it in the main server config, not in a
+ *    <VirtualHost>), and needs Apache 2.x with thread support. Health
+ *    checking is off if this isn't set.
+ *
+ *  OffloadHealthInterval <seconds>
+ *    ...how often to check each host, if OffloadHealthCheck is set. This
+ *    defaults to 10 seconds. This directive is server-wide.
+ *
+ *  OffloadHealthFailures <number>
+ *    ...how many checks in a row a host must fail before we stop sending
+ *    clients to it. This defaults to 2. This directive is server-wide.
  *
  *  OffloadDebug <On|Off>
  *    ...when on, will write details about every transaction to the error
@@ -55,6 +96,37 @@
  *    if not set, but can be set higher or lower. Zero will remove any
  *    minimum size check.
  *
+ *  OffloadMinPopularity <number>
+ *    ...files requested fewer than <number> times in the last
+ *    OffloadPopularityWindow are served by this server instead of being
+ *    offloaded. Sending a file that's only downloaded once or twice to an
+ *    offload server costs more than serving it here (the offload server
+ *    has to fetch it from us anyhow), and pushes more useful files out of
+ *    its cache. Counts are kept in shared memory, so they're approximate
+ *    (rare files can be overcounted; the few requests that arrive while a
+ *    new window is being set up aren't counted), and need Apache 2.x.
+ *    This defaults to 0, which offloads everything.
+ *
+ *  OffloadPopularityWindow <seconds>
+ *    ...how far back OffloadMinPopularity looks. This defaults to 600
+ *    seconds. This directive is server-wide.
+ *
+ *  OffloadTokenSecret <secret>
+ *    ...sign each redirect with <secret>, which must match GTOKENSECRET in
+ *    the offload servers' offload_server_config.h. The signed token tells
+ *    the offload server the file's ETag, size and modification time, so if
+ *    it already has that version cached, it can send it without asking this
+ *    server for the same details first. Offload servers that don't have a
+ *    secret ignore the token. Keep <secret> out of .htaccess files (this
+ *    directive isn't allowed there). Redirects aren't signed if this isn't
+ *    set.
+ *
+ *  OffloadTokenLifetime <seconds>
+ *    ...how long a signed redirect is good for. After that, the offload
+ *    server checks with this server like it would without a token, so a
+ *    changed or deleted file is never served from a stale token for longer
+ *    than this. Defaults to 300 seconds.
+ *
  *  OffloadExcludeMimeType <pattern>
  *    ...files with mimetypes matching <pattern> are never offloaded.
  *    This can be a wildcard pattern, so both "text/html" and "text/h*" are
@@ -66,7 +138,10 @@
  *
  *  OffloadExcludeAddress <pattern>
  *    ...clients from an IP address matching <pattern> are never 
- *    offloaded. This can be a wildcard pattern.
+ *    offloaded. This can be an address ("10.1.2.3", "2001:db8::1"), a
+ *    CIDR block ("10.0.0.0/8", "2001:db8::/32"), or a wildcard pattern.
+ *    Wildcards that just cover whole octets, like "192.168.*", are
+ *    treated as the matching CIDR block.
  *
  * For URLs where mod_offload is in effect, it'll go through a checklist.
  *  Anything in the checklist that fails means that offloading shouldn't
@@ -85,109 +160,1383 @@
  *  - Is the desired file's mimetype not listed in OffloadExcludeMimeType?
  *  - Is the client's User-Agent not listed in OffloadExcludeUserAgent?
  *  - Is the client's IP address not listed in OffloadExcludeAddress?
+ *  - Has the file been requested at least OffloadMinPopularity times?
+ *  - Is at least one OffloadHost passing its health checks?
  *
- * If the module makes it all the way through the checklist, it picks a
- *  random offload server (the server is chosen by the current
- *  time of day, with the chosen server changing once per second,
- *  rotating through the list of OffloadHost directives) and
+ * If the module makes it all the way through the checklist, it picks an
+ *  offload server (as OffloadBalance specifies: by the current time of day,
+ *  with the chosen server changing once per second, rotating through the
+ *  list of OffloadHost directives, by hashing the URI, or by load) and
  *  makes a 307 Redirect response to the client, pointing them to the
  *  offload server where they will receive the file.
  *
  *  This file written by Ryan C. Gordon (icculus@icculus.org).
  */
 
-#include "ap_config.h"
-#include "httpd.h"
-#include "http_request.h"
-#include "http_config.h"
-#include "http_core.h"
-#include "http_log.h"
-#include "http_main.h"
-#include "http_protocol.h"
+#include "ap_config.h"
+#include "httpd.h"
+#include "http_request.h"
+#include "http_config.h"
+#include "http_core.h"
+#include "http_log.h"
+#include "http_main.h"
+#include "http_protocol.h"
+
+#include <math.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+
+#define MOD_OFFLOAD_VER "1.0.3"
+#define DEFAULT_MIN_OFFLOAD_SIZE (5 * 1024)
+#define VERSION_COMPONENT "mod_offload/"MOD_OFFLOAD_VER
+
+/* some Apache 1.3/2.0 compatibility glue... */
+#ifndef STANDARD20_MODULE_STUFF
+   module MODULE_VAR_EXPORT offload_module;
+#  define TARGET_APACHE_1_3 1
+#  include "fnmatch.h"
+#  define wild_match(p,s) (ap_fnmatch(p, s, FNM_CASE_BLIND) == 0)
+#  define REQ_AUTH_TYPE(r) (r)->connection->ap_auth_type
+#  define FINFO_MODE(r) (r)->finfo.st_mode
+#  define FINFO_SIZE(r) (r)->finfo.st_size
+#  define apr_vsnprintf(a,b,c,d) ap_vsnprintf(a,b,c,d)
+#  define apr_table_get(a,b) ap_table_get(a,b)
+#  define apr_table_setn(a,b,c) ap_table_setn(a,b,c)
+#  define apr_pstrcat(a,b,c,d,e) ap_pstrcat(a,b,c,d,e)
+#  define apr_pstrdup(a,b) ap_pstrdup(a,b)
+#  define apr_palloc(a,b) ap_palloc(a,b)
+#  define apr_array_make(a,b,c) ap_make_array(a,b,c)
+#  define apr_array_push(a) ap_push_array(a)
+#  define AP_INIT_FLAG(a,b,c,d,e) { a,b,c,d,FLAG,e }
+#  define AP_INIT_TAKE1(a,b,c,d,e) { a,b,c,d,TAKE1,e }
+#  define AP_INIT_TAKE12(a,b,c,d,e) { a,b,c,d,TAKE12,e }
+#  include "ap_sha1.h"
+#  define apr_sha1_ctx_t AP_SHA1_CTX
+#  define apr_sha1_init(a) ap_SHA1Init(a)
+#  define apr_sha1_update(a,b,c) ap_SHA1Update(a,b,c)
+#  define apr_sha1_final(a,b) ap_SHA1Final(a,b)
+#  define APR_SHA1_DIGESTSIZE SHA_DIGESTSIZE
+#  define REQ_TIME_SECS(r) ((apr_uint64_t) (r)->request_time)
+#  define REQ_MTIME_SECS(r) ((apr_uint64_t) (r)->mtime)
+#  define FINFO_MTIME(r) (r)->finfo.st_mtime
+   typedef unsigned long long apr_uint64_t;
+   typedef struct in_addr apr_sockaddr_t;
+   typedef array_header apr_array_header_t;
+   typedef pool apr_pool_t;
+   typedef table apr_table_t;
+#else
+   module AP_MODULE_DECLARE_DATA offload_module;
+#  include "apr_strings.h"
+#  include "apr_lib.h"
+#  include "apr_fnmatch.h"
+#  define wild_match(p,s) (apr_fnmatch(p,s,APR_FNM_CASE_BLIND) == APR_SUCCESS)
+#  define REQ_AUTH_TYPE(r) (r)->ap_auth_type
+#  define FINFO_MODE(r) (r)->finfo.protection
+#  define FINFO_SIZE(r) (r)->finfo.size
+#  define FINFO_MTIME(r) (r)->finfo.mtime
+#  define REQ_TIME_SECS(r) ((apr_uint64_t) apr_time_sec((r)->request_time))
+#  define REQ_MTIME_SECS(r) ((apr_uint64_t) apr_time_sec((r)->mtime))
+#  include "apr_sha1.h"
+#  include "apr_version.h"
+#  include "apr_atomic.h"
+#  include "apr_shm.h"
+#  include "apr_time.h"
+#  include "apr_network_io.h"
+#  include "apr_thread_proc.h"
+#  define OFFLOAD_HEALTH_SUPPORTED APR_HAS_THREADS
+#  define OFFLOAD_SHM_SUPPORTED 1
+#endif
+
+#ifndef OFFLOAD_HEALTH_SUPPORTED
+#define OFFLOAD_HEALTH_SUPPORTED 0
+#endif
+
+#ifndef OFFLOAD_SHM_SUPPORTED
+#define OFFLOAD_SHM_SUPPORTED 0
+#endif
+
+#define DEFAULT_HOST_WEIGHT 1
+#define MAX_HOST_WEIGHT 10000
+#define DEFAULT_HEALTH_INTERVAL 10
+#define DEFAULT_HEALTH_FAILURES 2
+#define HEALTH_PROBE_TIMEOUT 5
+#define DEFAULT_POPULARITY_WINDOW 600
+#define DEFAULT_TOKEN_LIFETIME 300
+
+/* These have to match nph-offload.c's TOKEN_PARAM and TOKEN_MAC_BYTES. */
+#define OFFLOAD_TOKEN_PARAM "offload_token"
+#define OFFLOAD_TOKEN_MACLEN 16
+
+
+typedef enum
+{
+    OFFLOAD_BALANCE_TIME,
+    OFFLOAD_BALANCE_HASH,
+    OFFLOAD_BALANCE_LOAD
+} offload_balance_mode;
+
+typedef struct
+{
+    const char *name;   /* as specified to OffloadHost, maybe with a port. */
+    apr_uint64_t hash;  /* hash of (name), for rendezvous hashing. */
+    unsigned int weight;  /* share of traffic, relative to other hosts. */
+} offload_host_rec;
+
+/*
+ * The exclude lists can get long (hundreds of bot User-Agents, say), so we
+ *  don't want to apr_fnmatch() every pattern on every request. Nearly all
+ *  patterns are a literal with maybe a '*' on either end ("*Googlebot*",
+ *  "text/h*"). At config time, those get filed by a hash of their first
+ *  MATCHER_GRAM bytes, and a single pass over the string only compares the
+ *  literals whose first bytes hash the same as the bytes at each position.
+ *  Shorter literals, and patterns with wildcards in the middle, go on
+ *  lists that we check the slow way.
+ */
+#define MATCHER_GRAM 4
+#define MATCHER_BUCKETS 256
+
+#define MATCH_ANCHOR_START (1 << 0)  /* pattern didn't start with '*'. */
+#define MATCH_ANCHOR_END (1 << 1)    /* pattern didn't end with '*'. */
+
+typedef struct offload_literal
+{
+    const char *pattern;  /* as written in the config, for debug logging. */
+    const char *literal;  /* (pattern) without its leading/trailing '*'. */
+    size_t len;
+    int anchors;
+    struct offload_literal *next;
+} offload_literal;
+
+typedef struct
+{
+    offload_literal **buckets;  /* NULL until we get a long enough literal. */
+    offload_literal *short_literals;
+    apr_array_header_t *globs;  /* (char *) patterns for wild_match(). */
+} offload_matcher;
+
+/* an OffloadExcludeAddress that's an IP address or CIDR block. */
+typedef struct
+{
+    const char *pattern;
+    int family;  /* AF_INET or AF_INET6. */
+    unsigned char addr[16];
+    int bits;
+} offload_cidr;
+
+/*
+ * Every address that any OffloadHost resolved to (all A and AAAA records),
+ *  so we can tell in one lookup if a request is an offload server filling
+ *  its cache.
+ */
+#define ADDRSET_BUCKETS 64
+
+typedef struct offload_addr_entry
+{
+    int family;  /* AF_INET or AF_INET6. */
+    unsigned char addr[16];
+    const char *host;  /* the OffloadHost that resolved to this address. */
+    struct offload_addr_entry *next;
+} offload_addr_entry;
+
+/* These are server-wide, not per-directory. */
+typedef struct
+{
+    const char *health_uri;
+    int health_interval;
+    int health_failures;
+    int popularity_window;
+} offload_server_config;
+
+typedef struct
+{
+    int offload_engine_on;
+    int offload_debug;
+    int offload_min_size;
+    int offload_min_popularity;
+    const char *offload_token_secret;
+    int offload_token_lifetime;
+    offload_balance_mode offload_balance;
+    apr_array_header_t *offload_hosts;
+    offload_addr_entry **offload_addrs;  /* NULL if no hosts yet. */
+    offload_matcher offload_exclude_mime;
+    offload_matcher offload_exclude_agents;
+    offload_matcher offload_exclude_addr;  /* what isn't in exclude_cidrs. */
+    apr_array_header_t *offload_exclude_cidrs;
+} offload_dir_config;
+
+
+static void debugLog(const request_rec *r, const offload_dir_config *cfg,
+                     const char *fmt, ...)
+{
+    if (cfg->offload_debug)
+    {
+        char buf[512];
+        va_list ap;
+        va_start(ap, fmt);
+        apr_vsnprintf(buf, sizeof (buf), fmt, ap);
+        va_end(ap);
+        ap_log_rerror(APLOG_MARK,
+                      APLOG_NOERRNO|APLOG_ERR,
+                      #if !TARGET_APACHE_1_3
+                      APR_SUCCESS,
+                      #endif
+                      r, "mod_offload: %s", buf);
+    } /* if */
+} /* debugLog */
+
+
+static offload_server_config *get_server_config(server_rec *s)
+{
+    return (offload_server_config *) ap_get_module_config(s->module_config,
+                                                          &offload_module);
+} /* get_server_config */
+
+
+/* 64-bit FNV-1a, then a final avalanche so nearby inputs scatter well. */
+static apr_uint64_t offload_hash(const char *str, apr_uint64_t seed)
+{
+    apr_uint64_t h = 14695981039346656037ULL ^ seed;
+    while (*str)
+    {
+        h ^= (apr_uint64_t) ((unsigned char) *(str++));
+        h *= 1099511628211ULL;
+    } /* while */
+    return h;
+} /* offload_hash */
+
+
+static apr_uint64_t offload_mix(apr_uint64_t h)
+{
+    /* This is the SplitMix64 finalizer. */
+    h ^= h >> 30;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 27;
+    h *= 0x94D049BB133111EBULL;
+    h ^= h >> 31;
+    return h;
+} /* offload_mix */
+
+
+static void matcher_init(offload_matcher *m, apr_pool_t *p)
+{
+    m->buckets = NULL;
+    m->short_literals = NULL;
+    m->globs = apr_array_make(p, 0, sizeof (char *));
+} /* matcher_init */
+
+
+static int matcher_empty(const offload_matcher *m)
+{
+    return ((m->buckets == NULL) && (m->short_literals == NULL) &&
+            (m->globs->nelts == 0));
+} /* matcher_empty */
+
+
+static unsigned int matcher_gram(const char *str)
+{
+    unsigned int h = 0;
+    int i;
+    for (i = 0; i < MATCHER_GRAM; i++)
+        h = (h * 31) + (unsigned int) tolower((unsigned char) str[i]);
+    return h % MATCHER_BUCKETS;
+} /* matcher_gram */
+
+
+static void matcher_add(offload_matcher *m, apr_pool_t *p, const char *pattern)
+{
+    offload_literal *lit = NULL;
+    const char *start = pattern;
+    size_t len = 0;
+    int anchors = MATCH_ANCHOR_START | MATCH_ANCHOR_END;
+
+    while (*start == '*')
+    {
+        anchors &= ~MATCH_ANCHOR_START;
+        start++;
+    } /* while */
+
+    len = strlen(start);
+    while ((len > 0) && (start[len-1] == '*'))
+    {
+        anchors &= ~MATCH_ANCHOR_END;
+        len--;
+    } /* while */
+
+    /* any other wildcards (or escapes) mean we need real fnmatch. */
+    if ((memchr(start, '*', len)) || (memchr(start, '?', len)) ||
+        (memchr(start, '[', len)) || (memchr(start, '\\', len)))
+    {
+        char **glob = (char **) apr_array_push(m->globs);
+        *glob = apr_pstrdup(p, pattern);
+        return;
+    } /* if */
+
+    lit = (offload_literal *) apr_palloc(p, sizeof (offload_literal));
+    lit->pattern = apr_pstrdup(p, pattern);
+    lit->literal = lit->pattern + (start - pattern);
+    lit->len = len;
+    lit->anchors = anchors;
+
+    if (len < MATCHER_GRAM)
+    {
+        lit->next = m->short_literals;
+        m->short_literals = lit;
+    } /* if */
+
+    else
+    {
+        const unsigned int bucket = matcher_gram(lit->literal);
+        if (m->buckets == NULL)
+        {
+            const size_t buflen = sizeof (offload_literal *) * MATCHER_BUCKETS;
+            m->buckets = (offload_literal **) apr_palloc(p, buflen);
+            memset(m->buckets, '\0', buflen);
+        } /* if */
+        lit->next = m->buckets[bucket];
+        m->buckets[bucket] = lit;
+    } /* else */
+} /* matcher_add */
+
+
+/* does (lit) match (str), of (len) bytes, at offset (pos)? */
+static int literal_at(const offload_literal *lit, const char *str,
+                      size_t len, size_t pos)
+{
+    if (lit->len > len - pos)
+        return 0;
+    else if ((lit->anchors & MATCH_ANCHOR_START) && (pos != 0))
+        return 0;
+    else if ((lit->anchors & MATCH_ANCHOR_END) && (pos + lit->len != len))
+        return 0;
+    return (strncasecmp(str + pos, lit->literal, lit->len) == 0);
+} /* literal_at */
+
+
+/* returns the first pattern that matches (str), or NULL if none do. */
+static const char *matcher_find(const offload_matcher *m, const char *str)
+{
+    const size_t len = strlen(str);
+    const offload_literal *lit = NULL;
+    size_t pos;
+    int i;
+
+    if ((m->buckets != NULL) && (len >= MATCHER_GRAM))
+    {
+        for (pos = 0; pos <= len - MATCHER_GRAM; pos++)
+        {
+            for (lit = m->buckets[matcher_gram(str + pos)]; lit; lit = lit->next)
+            {
+                if (literal_at(lit, str, len, pos))
+                    return lit->pattern;
+            } /* for */
+        } /* for */
+    } /* if */
+
+    for (lit = m->short_literals; lit != NULL; lit = lit->next)
+    {
+        if (lit->len > len)
+            continue;
+        else if (lit->anchors & MATCH_ANCHOR_START)
+            pos = 0;
+        else if (lit->anchors & MATCH_ANCHOR_END)
+            pos = len - lit->len;
+        else
+        {
+            for (pos = 0; pos < len - lit->len; pos++)
+            {
+                if (literal_at(lit, str, len, pos))
+                    return lit->pattern;
+            } /* for */
+        } /* else */
+
+        if (literal_at(lit, str, len, pos))
+            return lit->pattern;
+    } /* for */
+
+    for (i = 0; i < m->globs->nelts; i++)
+    {
+        const char *glob = ((const char **) m->globs->elts)[i];
+        if (wild_match(glob, str))
+            return glob;
+    } /* for */
+
+    return NULL;
+} /* matcher_find */
+
+
+/*
+ * Parse an OffloadExcludeAddress as "1.2.3.4", "10.0.0.0/8", "2001:db8::/32",
+ *  or the old wildcard style "192.168.*". Returns zero if it's none of those.
+ */
+static int parse_cidr(const char *pattern, offload_cidr *cidr)
+{
+    char buf[64];
+    char *ptr = NULL;
+    size_t len = strlen(pattern);
+    int octets[3];
+    int total = 0;
+    int i;
+
+    if (len >= sizeof (buf))
+        return 0;
+
+    memset(cidr, '\0', sizeof (*cidr));
+    cidr->pattern = pattern;
+
+    /* "10.*", "10.1.*", "10.1.2.*": whole octets, then a '*'. */
+    if ((len > 2) && (strcmp(pattern + len - 2, ".*") == 0))
+    {
+        const char *p = pattern;
+        while ((total < 3) && (isdigit((unsigned char) *p)))
+        {
+            octets[total] = (int) strtol(p, &ptr, 10);
+            if ((octets[total] > 255) || (*ptr != '.'))
+                return 0;
+            total++;
+            p = ptr + 1;
+            if (p == pattern + len - 1)  /* at the '*'? */
+                break;
+        } /* while */
+
+        if (p != pattern + len - 1)
+            return 0;
+
+        cidr->family = AF_INET;
+        for (i = 0; i < total; i++)
+            cidr->addr[i] = (unsigned char) octets[i];
+        cidr->bits = total * 8;
+        return 1;
+    } /* if */
+
+    memcpy(buf, pattern, len + 1);
+    ptr = strchr(buf, '/');
+    if (ptr != NULL)
+        *(ptr++) = '\0';
+
+    if (inet_pton(AF_INET, buf, cidr->addr) == 1)
+    {
+        cidr->family = AF_INET;
+        cidr->bits = 32;
+    } /* if */
+    else if (inet_pton(AF_INET6, buf, cidr->addr) == 1)
+    {
+        cidr->family = AF_INET6;
+        cidr->bits = 128;
+    } /* else if */
+    else
+    {
+        return 0;
+    } /* else */
+
+    if (ptr != NULL)
+    {
+        char *end = NULL;
+        const long bits = strtol(ptr, &end, 10);
+        if ((*ptr == '\0') || (*end != '\0') || (bits < 0) || (bits > cidr->bits))
+            return 0;
+        cidr->bits = (int) bits;
+    } /* if */
+
+    return 1;
+} /* parse_cidr */
+
+
+static int cidr_match(const offload_cidr *cidr, int family,
+                      const unsigned char *addr)
+{
+    const int bytes = cidr->bits / 8;
+    const int bits = cidr->bits % 8;
+
+    if (family != cidr->family)
+        return 0;
+    else if (memcmp(addr, cidr->addr, bytes) != 0)
+        return 0;
+    else if (bits == 0)
+        return 1;
+    else
+    {
+        const unsigned char mask = (unsigned char) (0xFF << (8 - bits));
+        return ((addr[bytes] & mask) == (cidr->addr[bytes] & mask));
+    } /* else */
+} /* cidr_match */
+
+
+#if !TARGET_APACHE_1_3
+/*
+ * Get an address as raw bytes, and return its family (or zero if it's not
+ *  IPv4 or IPv6). IPv4 addresses that show up as IPv6-mapped addresses
+ *  (::ffff:1.2.3.4) are reported as IPv4, so they match IPv4 rules.
+ */
+static int sockaddr_bytes(const apr_sockaddr_t *sa, unsigned char *addr)
+{
+    if (sa->family == APR_INET)
+    {
+        memcpy(addr, &sa->sa.sin.sin_addr, 4);
+        return AF_INET;
+    } /* if */
+
+    #if APR_HAVE_IPV6
+    else if (sa->family == APR_INET6)
+    {
+        const unsigned char *bytes = (const unsigned char *) &sa->sa.sin6.sin6_addr;
+        static const unsigned char v4mapped[12] = {0,0,0,0,0,0,0,0,0,0,0xFF,0xFF};
+        if (memcmp(bytes, v4mapped, sizeof (v4mapped)) == 0)
+        {
+            memcpy(addr, bytes + 12, 4);
+            return AF_INET;
+        } /* if */
+        memcpy(addr, bytes, 16);
+        return AF_INET6;
+    } /* else if */
+    #endif
+
+    return 0;
+} /* sockaddr_bytes */
+#endif
+
+
+static int client_addr_bytes(const request_rec *r, unsigned char *addr)
+{
+    #if TARGET_APACHE_1_3
+    memcpy(addr, &r->connection->remote_addr.sin_addr, 4);
+    return AF_INET;
+    #else
+    return sockaddr_bytes(r->connection->remote_addr, addr);
+    #endif
+} /* client_addr_bytes */
+
+
+static unsigned int addrset_bucket(int family, const unsigned char *addr)
+{
+    const int len = (family == AF_INET) ? 4 : 16;
+    apr_uint64_t h = 14695981039346656037ULL;
+    int i;
+    for (i = 0; i < len; i++)
+    {
+        h ^= (apr_uint64_t) addr[i];
+        h *= 1099511628211ULL;
+    } /* for */
+    return (unsigned int) (offload_mix(h) % ADDRSET_BUCKETS);
+} /* addrset_bucket */
+
+
+static void addrset_add(offload_dir_config *cfg, apr_pool_t *p, int family,
+                        const unsigned char *addr, const char *host)
+{
+    const int len = (family == AF_INET) ? 4 : 16;
+    unsigned int bucket;
+    offload_addr_entry *entry;
+
+    if (family == 0)
+        return;
+    else if (cfg->offload_addrs == NULL)
+    {
+        const size_t buflen = sizeof (offload_addr_entry *) * ADDRSET_BUCKETS;
+        cfg->offload_addrs = (offload_addr_entry **) apr_palloc(p, buflen);
+        memset(cfg->offload_addrs, '\0', buflen);
+    } /* else if */
+
+    bucket = addrset_bucket(family, addr);
+    for (entry = cfg->offload_addrs[bucket]; entry; entry = entry->next)
+    {
+        if ((entry->family == family) && (memcmp(entry->addr, addr, len) == 0))
+            return;  /* already have it. */
+    } /* for */
+
+    entry = (offload_addr_entry *) apr_palloc(p, sizeof (offload_addr_entry));
+    memset(entry->addr, '\0', sizeof (entry->addr));
+    memcpy(entry->addr, addr, len);
+    entry->family = family;
+    entry->host = host;
+    entry->next = cfg->offload_addrs[bucket];
+    cfg->offload_addrs[bucket] = entry;
+} /* addrset_add */
+
+
+/* returns the OffloadHost that (r) is coming from, or NULL. */
+static const char *request_from_offload_host(const offload_dir_config *cfg,
+                                             const request_rec *r)
+{
+    const offload_addr_entry *entry;
+    unsigned char addr[16];
+    int family;
+    int len;
+
+    if (cfg->offload_addrs == NULL)
+        return NULL;
+
+    family = client_addr_bytes(r, addr);
+    if (family == 0)
+        return NULL;
+
+    len = (family == AF_INET) ? 4 : 16;
+    for (entry = cfg->offload_addrs[addrset_bucket(family, addr)]; entry; entry = entry->next)
+    {
+        if ((entry->family == family) && (memcmp(entry->addr, addr, len) == 0))
+            return entry->host;
+    } /* for */
+
+    return NULL;
+} /* request_from_offload_host */
+
+
+#if OFFLOAD_HEALTH_SUPPORTED
+/*
+ * Health state for each offload host lives in shared memory, created in
+ *  the parent at startup and inherited by every child. OffloadHost can
+ *  show up in .htaccess files, so we can't know every host in advance;
+ *  hosts claim a slot the first time a request considers them, keyed on
+ *  the hash of their name. If the table fills up, extra hosts are just
+ *  never checked (and always considered up).
+ */
+#define MAX_SHARED_HOSTS 64
+#define SHARED_HOST_NAMELEN 128
+
+typedef enum
+{
+    HOSTSLOT_FREE,
+    HOSTSLOT_CLAIMED,  /* someone is filling in this slot right now. */
+    HOSTSLOT_READY
+} offload_hostslot_state;
+
+/* a claim is a handful of stores, so it's done almost at once. We give up
+ *  on one that isn't after this long, in case its child died mid-claim. */
+#define HOSTSLOT_CLAIM_WAITS 20
+#define HOSTSLOT_CLAIM_WAIT_USECS 50
+
+typedef struct
+{
+    volatile apr_uint32_t state;       /* an offload_hostslot_state. */
+    apr_uint64_t hash;
+    char name[SHARED_HOST_NAMELEN];
+    volatile apr_uint32_t down;        /* non-zero if we stopped using it. */
+    volatile apr_uint32_t failures;    /* consecutive failed probes. */
+    volatile apr_uint32_t next_probe;  /* apr_time_sec() of next probe. */
+    volatile apr_uint32_t has_load;    /* non-zero if it reports its load. */
+    volatile apr_uint32_t active;      /* its connections at last probe. */
+    volatile apr_uint32_t redirects;   /* clients we sent since last probe. */
+    volatile apr_uint32_t kbytes_sec;  /* its egress between last probes. */
+    apr_uint64_t sent_bytes;  /* only touched by whoever is probing. */
+    apr_uint32_t sent_time;
+    apr_uint32_t sent_uptime;
+} offload_host_state;
+
+/* what nph-offload's status page reports in its X-Offload-Load header. */
+typedef struct
+{
+    int valid;
+    apr_uint32_t active;
+    apr_uint64_t sent;
+    apr_uint32_t uptime;
+} offload_host_load;
+
+typedef struct
+{
+    offload_host_state hosts[MAX_SHARED_HOSTS];
+} offload_shared_data;
+
+static apr_shm_t *offload_shm = NULL;
+static offload_shared_data *offload_shared = NULL;
+
+
+/* Returns (slot)'s state, once nobody is in the middle of claiming it. */
+static apr_uint32_t settled_host_state(offload_host_state *slot)
+{
+    apr_uint32_t state = apr_atomic_read32(&slot->state);
+    int tries = 0;
+    while ((state == HOSTSLOT_CLAIMED) && (tries++ < HOSTSLOT_CLAIM_WAITS))
+    {
+        apr_sleep(HOSTSLOT_CLAIM_WAIT_USECS);
+        state = apr_atomic_read32(&slot->state);
+    } /* while */
+    return state;
+} /* settled_host_state */
+
+
+static offload_host_state *get_host_state(const request_rec *r,
+                                          const offload_host_rec *host)
+{
+    const size_t namelen = strlen(host->name);
+    int i;
+
+    if (offload_shared == NULL)  /* health checks are disabled. */
+        return NULL;
+    else if (namelen >= SHARED_HOST_NAMELEN)
+        return NULL;
+
+    for (i = 0; i < MAX_SHARED_HOSTS; i++)
+    {
+        const int idx = (int) ((host->hash + i) % MAX_SHARED_HOSTS);
+        offload_host_state *slot = &offload_shared->hosts[idx];
+        /* another child might be claiming this slot for the same host, so
+         *  wait to see whose it is, or we'd both end up with one. */
+        apr_uint32_t state = settled_host_state(slot);
+        int claimed = 0;
+        if (state == HOSTSLOT_FREE)
+        {
+            if (apr_atomic_cas32(&slot->state, HOSTSLOT_CLAIMED, HOSTSLOT_FREE) == HOSTSLOT_FREE)
+                claimed = 1;
+            else
+                state = settled_host_state(slot);  /* someone beat us to it. */
+        } /* if */
+
+        if (state == HOSTSLOT_READY)
+        {
+            if ((slot->hash == host->hash) && (strcmp(slot->name, host->name) == 0))
+                return slot;
+        } /* if */
+
+        else if (claimed)
+        {
+            slot->hash = host->hash;
+            memcpy(slot->name, host->name, namelen + 1);
+            apr_atomic_set32(&slot->down, 0);
+            apr_atomic_set32(&slot->failures, 0);
+            apr_atomic_set32(&slot->next_probe, 0);  /* probe soon. */
+            apr_atomic_set32(&slot->has_load, 0);
+            apr_atomic_set32(&slot->active, 0);
+            apr_atomic_set32(&slot->redirects, 0);
+            apr_atomic_set32(&slot->kbytes_sec, 0);
+            slot->sent_bytes = 0;
+            slot->sent_time = 0;
+            slot->sent_uptime = 0;
+            apr_atomic_xchg32(&slot->state, HOSTSLOT_READY);
+            return slot;
+        } /* else if */
+    } /* for */
+
+    return NULL;  /* table is full. Oh well. */
+} /* get_host_state */
+
+
+static int host_is_up(const request_rec *r, const offload_host_rec *host)
+{
+    offload_host_state *state = get_host_state(r, host);
+    return ((state == NULL) || (apr_atomic_read32(&state->down) == 0));
+} /* host_is_up */
+
+
+/* Fills in (load) from an "X-Offload-Load:" line in (headers), if any. */
+static void parse_host_load(const char *headers, offload_host_load *load)
+{
+    static const char key[] = "\nX-Offload-Load:";
+    const char *ptr = headers;
+    const char *val = NULL;
+
+    while ((ptr = strchr(ptr, '\n')) != NULL)
+    {
+        if (strncasecmp(ptr, key, sizeof (key) - 1) == 0)
+            break;
+        ptr++;
+    } /* while */
+
+    if (ptr == NULL)
+        return;  /* not an offload server's status page. */
+
+    ptr += sizeof (key) - 1;
+    while ((*ptr != '\0') && (*ptr != '\r') && (*ptr != '\n'))
+    {
+        while (*ptr == ' ')
+            ptr++;
+        if ((val = strchr(ptr, '=')) == NULL)
+            break;
+        val++;
+        if (strncmp(ptr, "active=", 7) == 0)
+            load->active = (apr_uint32_t) strtoul(val, NULL, 10);
+        else if (strncmp(ptr, "sent=", 5) == 0)
+            load->sent = (apr_uint64_t) strtoull(val, NULL, 10);
+        else if (strncmp(ptr, "uptime=", 7) == 0)
+            load->uptime = (apr_uint32_t) strtoul(val, NULL, 10);
+        while ((*ptr != '\0') && (*ptr != ' ') && (*ptr != '\r') && (*ptr != '\n'))
+            ptr++;
+    } /* while */
+
+    load->valid = 1;
+} /* parse_host_load */
+
+
+/*
+ * Returns non-zero if (name) answered our HEAD request with a 2xx or 3xx.
+ *  If it's an offload server's status page, (load) gets what it reported.
+ */
+static int probe_host(const char *name, const char *uri,
+                      offload_host_load *load, apr_pool_t *p)
+{
+    char host[SHARED_HOST_NAMELEN];
+    char response[1024];
+    char *hostname = NULL;
+    apr_port_t port = 80;
+    apr_sockaddr_t *addr = NULL;
+    apr_socket_t *sock = NULL;
+    apr_size_t len = 0;
+    const char *req = NULL;
+    char *ptr = NULL;
+    int status = 0;
+
+    memset(load, '\0', sizeof (*load));
+    apr_cpystrn(host, name, sizeof (host));
+    hostname = host;
+    if (*hostname == '[')  /* "[2001:db8::1]:8080" */
+    {
+        hostname++;
+        ptr = strchr(hostname, ']');
+        if (ptr == NULL)
+            return 0;
+        *(ptr++) = '\0';
+    } /* if */
+
+    ptr = strchr((ptr != NULL) ? ptr : hostname, ':');
+    if (ptr != NULL)
+    {
+        *(ptr++) = '\0';
+        port = (apr_port_t) atoi(ptr);
+    } /* if */
+
+    if (apr_sockaddr_info_get(&addr, hostname, APR_UNSPEC, port, 0, p) != APR_SUCCESS)
+        return 0;
+
+    #if APR_MAJOR_VERSION < 1
+    if (apr_socket_create(&sock, addr->family, SOCK_STREAM, p) != APR_SUCCESS)
+    #else
+    if (apr_socket_create(&sock, addr->family, SOCK_STREAM, APR_PROTO_TCP, p) != APR_SUCCESS)
+    #endif
+        return 0;
+
+    apr_socket_timeout_set(sock, apr_time_from_sec(HEALTH_PROBE_TIMEOUT));
+    if (apr_socket_connect(sock, addr) == APR_SUCCESS)
+    {
+        req = apr_pstrcat(p, "HEAD ", uri, " HTTP/1.0\r\n"
+                             "Host: ", name, "\r\n"
+                             "User-Agent: ", VERSION_COMPONENT, "\r\n"
+                             "Connection: close\r\n\r\n", NULL);
+        len = strlen(req);
+        if (apr_socket_send(sock, req, &len) == APR_SUCCESS)
+        {
+            /* read the status line and headers; there's no body. */
+            apr_size_t br = 0;
+            while (br < sizeof (response) - 1)
+            {
+                len = sizeof (response) - 1 - br;
+                if (apr_socket_recv(sock, response + br, &len) != APR_SUCCESS)
+                    break;
+                br += len;
+                response[br] = '\0';
+                if (strstr(response, "\r\n\r\n") != NULL)
+                    break;
+            } /* while */
+            response[br] = '\0';
+
+            if ((strncmp(response, "HTTP/", 5) == 0) &&
+                ((ptr = strchr(response, ' ')) != NULL))
+                status = atoi(ptr + 1);
+
+            if ((status >= 200) && (status < 300))
+                parse_host_load(response, load);
+        } /* if */
+    } /* if */
+
+    apr_socket_close(sock);
+    return ((status >= 200) && (status < 400));
+} /* probe_host */
+
+
+/* Publish what a probe found out about a host's load. Prober only. */
+static void update_host_load(offload_host_state *slot,
+                             const offload_host_load *load,
+                             apr_uint32_t now)
+{
+    if (!load->valid)
+    {
+        apr_atomic_set32(&slot->has_load, 0);
+        return;
+    } /* if */
+
+    /* measure egress since the last probe, unless it restarted since. */
+    if ( (slot->sent_time != 0) && (now > slot->sent_time) &&
+         (load->uptime >= slot->sent_uptime) &&
+         (load->sent >= slot->sent_bytes) )
+    {
+        const apr_uint64_t bytes = load->sent - slot->sent_bytes;
+        const apr_uint64_t secs = (apr_uint64_t) (now - slot->sent_time);
+        apr_atomic_set32(&slot->kbytes_sec, (apr_uint32_t) ((bytes / 1024) / secs));
+    } /* if */
+
+    slot->sent_bytes = load->sent;
+    slot->sent_time = now;
+    slot->sent_uptime = load->uptime;
+
+    apr_atomic_set32(&slot->active, load->active);
+    apr_atomic_set32(&slot->redirects, 0);  /* (active) counts them now. */
+    apr_atomic_set32(&slot->has_load, 1);
+} /* update_host_load */
+
+
+/*
+ * Every child runs one of these, but they agree through shared memory on
+ *  who probes each host next: whoever moves a host's next_probe time
+ *  forward first does the probe, so each host gets checked once per
+ *  interval, no matter how many children there are.
+ */
+static void * APR_THREAD_FUNC health_thread(apr_thread_t *thread, void *data)
+{
+    server_rec *s = (server_rec *) data;
+    const offload_server_config *scfg = get_server_config(s);
+    apr_pool_t *pool = NULL;
+    offload_host_load load;
+    int i;
+
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        return NULL;
+
+    while (1)
+    {
+        apr_sleep(apr_time_from_sec(1));
+
+        for (i = 0; i < MAX_SHARED_HOSTS; i++)
+        {
+            offload_host_state *slot = &offload_shared->hosts[i];
+            const apr_uint32_t now = (apr_uint32_t) apr_time_sec(apr_time_now());
+            const apr_uint32_t due = apr_atomic_read32(&slot->next_probe);
+            const apr_uint32_t next = now + scfg->health_interval;
+
+            if (apr_atomic_read32(&slot->state) != HOSTSLOT_READY)
+                continue;
+            else if (now < due)
+                continue;
+            else if (apr_atomic_cas32(&slot->next_probe, next, due) != due)
+                continue;  /* another child got this one. */
+
+            if (probe_host(slot->name, scfg->health_uri, &load, pool))
+            {
+                update_host_load(slot, &load, now);
+                apr_atomic_set32(&slot->failures, 0);
+                if (apr_atomic_xchg32(&slot->down, 0) != 0)
+                {
+                    ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_NOTICE, 0, s,
+                                 "mod_offload: offload host '%s' is back up.",
+                                 slot->name);
+                } /* if */
+            } /* if */
+
+            else if (apr_atomic_inc32(&slot->failures) + 1 >= (apr_uint32_t) scfg->health_failures)
+            {
+                if (apr_atomic_xchg32(&slot->down, 1) == 0)
+                {
+                    ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_WARNING, 0, s,
+                                 "mod_offload: offload host '%s' failed health"
+                                 " checks; not offloading to it.", slot->name);
+                } /* if */
+            } /* else if */
+
+            apr_pool_clear(pool);
+        } /* for */
+    } /* while */
+
+    return NULL;
+} /* health_thread */
+
+#else
+#define host_is_up(r, host) (1)
+#endif
+
+
+/* (nth) is in [0, total weight of hosts[up]); returns the host it lands on. */
+static int pick_weighted(const offload_host_rec *hosts, const int *up,
+                         int total, apr_uint64_t nth)
+{
+    int i;
+    for (i = 0; i < total - 1; i++)
+    {
+        if (nth < hosts[up[i]].weight)
+            break;
+        nth -= hosts[up[i]].weight;
+    } /* for */
+    return up[i];
+} /* pick_weighted */
+
+
+#if OFFLOAD_HEALTH_SUPPORTED
+/* how busy a host is right now, by the numbers our health checks got. */
+static apr_uint32_t host_load(offload_host_state *slot)
+{
+    return apr_atomic_read32(&slot->active) + apr_atomic_read32(&slot->redirects);
+} /* host_load */
+
+
+/*
+ * non-zero if (a) is a better choice than (b). Load is compared per unit
+ *  of weight: a host with twice the weight should carry twice the load.
+ */
+static int host_less_loaded(offload_host_state *a, unsigned int weighta,
+                            offload_host_state *b, unsigned int weightb)
+{
+    const apr_uint64_t loada = ((apr_uint64_t) host_load(a)) * weightb;
+    const apr_uint64_t loadb = ((apr_uint64_t) host_load(b)) * weighta;
+    const apr_uint64_t kbytesa = ((apr_uint64_t) apr_atomic_read32(&a->kbytes_sec)) * weightb;
+    const apr_uint64_t kbytesb = ((apr_uint64_t) apr_atomic_read32(&b->kbytes_sec)) * weighta;
+    if (loada != loadb)
+        return (loada < loadb);
+    return (kbytesa <= kbytesb);
+} /* host_less_loaded */
+
+
+/*
+ * "Power of two choices": pick two hosts at random (weighted) and send the
+ *  client to the less busy one. Always taking the least busy host makes every child
+ *  pile onto it until the next health check notices; comparing a random
+ *  pair spreads the load almost as well without that herding. Load data
+ *  is a few seconds stale, so we also count our own redirects since the
+ *  last probe. Falls back to Time when there's no load data to go on.
+ */
+static int choose_host_by_load(const offload_dir_config *cfg,
+                               const request_rec *r)
+{
+    const offload_host_rec *hosts = (const offload_host_rec *) cfg->offload_hosts->elts;
+    const int nelts = cfg->offload_hosts->nelts;
+    offload_host_state **slots = NULL;
+    apr_uint64_t rnd = 0;
+    int *up = NULL;
+    int total = 0;
+    apr_uint64_t weights = 0;
+    int a, b;
+    int i;
+
+    if (offload_shared == NULL)
+        return -1;
+
+    slots = (offload_host_state **) apr_palloc(r->pool, sizeof (*slots) * nelts);
+    up = (int *) apr_palloc(r->pool, sizeof (int) * nelts);
+    for (i = 0; i < nelts; i++)
+    {
+        slots[i] = get_host_state(r, &hosts[i]);
+        if (slots[i] == NULL)
+            return -1;  /* host table is full; we can't track everyone. */
+        else if (!apr_atomic_read32(&slots[i]->has_load))
+            return -1;  /* not probed yet, or not reporting its load. */
+        else if (!apr_atomic_read32(&slots[i]->down))
+        {
+            up[total++] = i;
+            weights += hosts[i].weight;
+        } /* else if */
+    } /* for */
+
+    if (total == 0)
+        return -1;
+
+    rnd = offload_mix(((apr_uint64_t) apr_time_now()) ^ ((apr_uint64_t) (size_t) r));
+    a = pick_weighted(hosts, up, total, (rnd & 0xFFFFFFFF) % weights);
+    b = pick_weighted(hosts, up, total, (rnd >> 32) % weights);
+    if ((a != b) && (!host_less_loaded(slots[a], hosts[a].weight,
+                                       slots[b], hosts[b].weight)))
+        a = b;
+
+    apr_atomic_inc32(&slots[a]->redirects);
+    return a;
+} /* choose_host_by_load */
+#else
+#define choose_host_by_load(cfg, r) (-1)
+#endif
+
+
+#if OFFLOAD_SHM_SUPPORTED
+/*
+ * Request counts per URI, for OffloadMinPopularity, kept in a count-min
+ *  sketch in shared memory: each URI bumps one counter in each row, and
+ *  its count is the smallest of those, since other URIs that share a
+ *  counter can only push it up. That's a fixed 256 kilobytes no matter how
+ *  many files you have, at the cost of sometimes overcounting rare files.
+ *
+ * There are two sketches: the current OffloadPopularityWindow and the one
+ *  before it. Counts from the previous window fade out as the current one
+ *  goes on, which is close enough to a true sliding window.
+ */
+#define POPULARITY_DEPTH 4
+#define POPULARITY_WIDTH 8192
+
+/* a sketch's epoch while it's being wiped for a new window. */
+#define POPULARITY_CLEARING 0xFFFFFFFF
+
+/* a wipe takes microseconds; if one has gone on this many seconds, the
+ *  child doing it died, and someone else finishes it. */
+#define POPULARITY_CLEAR_TIMEOUT 2
+
+typedef struct
+{
+    volatile apr_uint32_t epoch;  /* which window this sketch is counting. */
+    volatile apr_uint32_t clear_started;  /* apr_time_sec() of last wipe. */
+    volatile apr_uint32_t counts[POPULARITY_DEPTH][POPULARITY_WIDTH];
+} offload_sketch;
+
+typedef struct
+{
+    offload_sketch sketches[2];
+} offload_popularity_data;
+
+static apr_shm_t *offload_popularity_shm = NULL;
+static offload_popularity_data *offload_popularity = NULL;
+static int offload_popularity_window = DEFAULT_POPULARITY_WINDOW;
+
+
+/*
+ * Returns NULL if nobody can count in this window's sketch right now,
+ *  because another child is still wiping it. (now) is apr_time_sec().
+ */
+static offload_sketch *get_sketch(apr_uint32_t epoch, apr_uint32_t now)
+{
+    offload_sketch *sketch = &offload_popularity->sketches[epoch % 2];
+    const apr_uint32_t old = apr_atomic_read32(&sketch->epoch);
+    if (old == epoch)
+        return sketch;
+    else if (old == POPULARITY_CLEARING)
+    {
+        /* if whoever was wiping it died, take over, but only one of us. */
+        const apr_uint32_t started = apr_atomic_read32(&sketch->clear_started);
+        if ((now - started) <= POPULARITY_CLEAR_TIMEOUT)
+            return NULL;
+        else if (apr_atomic_cas32(&sketch->clear_started, now, started) != started)
+            return NULL;
+    } /* else if */
+
+    /*
+     * first one into a new window clears out the one from two ago. It
+     *  only says the sketch is for the new window once it's empty, so
+     *  nobody's counts for the new window get wiped.
+     */
+    else if (apr_atomic_cas32(&sketch->epoch, POPULARITY_CLEARING, old) != old)
+        return NULL;
+    else
+        apr_atomic_set32(&sketch->clear_started, now);
+
+    memset((void *) sketch->counts, '\0', sizeof (sketch->counts));
+    apr_atomic_set32(&sketch->epoch, epoch);
+    return sketch;
+} /* get_sketch */
+
+
+/*
+ * Count this request for (r)'s URI, and return about how many times it
+ *  was requested in the last OffloadPopularityWindow seconds.
+ */
+static apr_uint32_t count_popularity(const request_rec *r)
+{
+    const apr_uint32_t now = (apr_uint32_t) apr_time_sec(apr_time_now());
+    const apr_uint32_t window = (apr_uint32_t) offload_popularity_window;
+    const apr_uint32_t epoch = now / window;
+    const apr_uint32_t remaining = window - (now % window);
+    const char *vhost = r->server->server_hostname;
+    const apr_uint64_t h = offload_hash(r->uri, offload_hash(vhost ? vhost : "", 0));
+    offload_sketch *cur = get_sketch(epoch, now);
+    offload_sketch *prev = &offload_popularity->sketches[(epoch + 1) % 2];
+    const int use_prev = (apr_atomic_read32(&prev->epoch) == epoch - 1);
+    apr_uint32_t retval = 0;
+    int row;
+
+    for (row = 0; row < POPULARITY_DEPTH; row++)
+    {
+        const apr_uint64_t rowhash = offload_mix(h + (row * 0x9E3779B97F4A7C15ULL));
+        const int idx = (int) (rowhash % POPULARITY_WIDTH);
+        apr_uint32_t count = 1;  /* this request, at least. */
+        if (cur != NULL)
+            count = apr_atomic_inc32(&cur->counts[row][idx]) + 1;
+        if (use_prev)
+        {
+            const apr_uint64_t old = apr_atomic_read32(&prev->counts[row][idx]);
+            count += (apr_uint32_t) ((old * remaining) / window);
+        } /* if */
 
-#define MOD_OFFLOAD_VER "1.0.3"
-#define DEFAULT_MIN_OFFLOAD_SIZE (5 * 1024)
-#define VERSION_COMPONENT "mod_offload/"MOD_OFFLOAD_VER
+        if ((row == 0) || (count < retval))
+            retval = count;
+    } /* for */
 
-/* some Apache 1.3/2.0 compatibility glue... */
-#ifndef STANDARD20_MODULE_STUFF
-   module MODULE_VAR_EXPORT offload_module;
-#  define TARGET_APACHE_1_3 1
-#  include "fnmatch.h"
-#  define wild_match(p,s) (ap_fnmatch(p, s, FNM_CASE_BLIND) == 0)
-#  define REQ_AUTH_TYPE(r) (r)->connection->ap_auth_type
-#  define FINFO_MODE(r) (r)->finfo.st_mode
-#  define FINFO_SIZE(r) (r)->finfo.st_size
-#  define apr_vsnprintf(a,b,c,d) ap_vsnprintf(a,b,c,d)
-#  define apr_table_get(a,b) ap_table_get(a,b)
-#  define apr_table_setn(a,b,c) ap_table_setn(a,b,c)
-#  define apr_pstrcat(a,b,c,d,e) ap_pstrcat(a,b,c,d,e)
-#  define apr_pstrdup(a,b) ap_pstrdup(a,b)
-#  define apr_palloc(a,b) ap_palloc(a,b)
-#  define apr_array_make(a,b,c) ap_make_array(a,b,c)
-#  define apr_array_push(a) ap_push_array(a)
-#  define AP_INIT_FLAG(a,b,c,d,e) { a,b,c,d,FLAG,e }
-#  define AP_INIT_TAKE1(a,b,c,d,e) { a,b,c,d,TAKE1,e }
-   typedef struct in_addr apr_sockaddr_t;
-   typedef array_header apr_array_header_t;
-   typedef pool apr_pool_t;
-   typedef table apr_table_t;
-#else
-   module AP_MODULE_DECLARE_DATA offload_module;
-#  include "apr_strings.h"
-#  include "apr_lib.h"
-#  include "apr_fnmatch.h"
-#  define wild_match(p,s) (apr_fnmatch(p,s,APR_FNM_CASE_BLIND) == APR_SUCCESS)
-#  define REQ_AUTH_TYPE(r) (r)->ap_auth_type
-#  define FINFO_MODE(r) (r)->finfo.protection
-#  define FINFO_SIZE(r) (r)->finfo.size
+    return retval;
+} /* count_popularity */
 #endif
 
 
-typedef struct
+/*
+ * Rendezvous ("highest random weight") hashing: every host gets a score
+ *  for this URI, and the highest score wins. Each URI lands on the same
+ *  host every time, and removing a host only moves the URIs that it
+ *  was winning. Scoring with -weight/ln(x), for a hash x in (0,1), makes
+ *  each host win in proportion to its weight.
+ */
+static int choose_host_by_hash(const offload_dir_config *cfg,
+                               const request_rec *r)
 {
-    int offload_engine_on;
-    int offload_debug;
-    int offload_min_size;
-    apr_array_header_t *offload_hosts;
-    apr_array_header_t *offload_ips;
-    apr_array_header_t *offload_exclude_mime;
-    apr_array_header_t *offload_exclude_agents;
-    apr_array_header_t *offload_exclude_addr;
-} offload_dir_config;
+    const offload_host_rec *hosts = (const offload_host_rec *) cfg->offload_hosts->elts;
+    const apr_uint64_t urihash = offload_hash(r->uri, 0);
+    double best = 0.0;
+    int retval = -1;
+    int i;
+
+    for (i = 0; i < cfg->offload_hosts->nelts; i++)
+    {
+        const apr_uint64_t h = offload_mix(urihash ^ hosts[i].hash);
+        const double x = (((double) (h >> 11)) + 0.5) / 9007199254740992.0;
+        const double score = -((double) hosts[i].weight) / log(x);
+        if (((retval == -1) || (score > best)) && (host_is_up(r, &hosts[i])))
+        {
+            best = score;
+            retval = i;
+        } /* if */
+    } /* for */
 
+    return retval;
+} /* choose_host_by_hash */
 
-static void debugLog(const request_rec *r, const offload_dir_config *cfg,
-                     const char *fmt, ...)
+
+static int choose_host_by_time(const offload_dir_config *cfg,
+                               const request_rec *r)
 {
-    if (cfg->offload_debug)
+    const offload_host_rec *hosts = (const offload_host_rec *) cfg->offload_hosts->elts;
+    const int nelts = cfg->offload_hosts->nelts;
+    int *up = (int *) apr_palloc(r->pool, sizeof (int) * nelts);
+    apr_uint64_t weights = 0;
+    int total = 0;
+    int i;
+
+    for (i = 0; i < nelts; i++)
     {
-        char buf[512];
-        va_list ap;
-        va_start(ap, fmt);
-        apr_vsnprintf(buf, sizeof (buf), fmt, ap);
-        va_end(ap);
-        ap_log_rerror(APLOG_MARK,
-                      APLOG_NOERRNO|APLOG_ERR,
-                      #if !TARGET_APACHE_1_3
-                      APR_SUCCESS,
-                      #endif
-                      r, "mod_offload: %s", buf);
-    } /* if */
-} /* debugLog */
+        if (host_is_up(r, &hosts[i]))
+        {
+            up[total++] = i;
+            weights += hosts[i].weight;
+        } /* if */
+    } /* for */
+
+    if (total == 0)
+        return -1;
+
+    /* each second goes to one host; heavier hosts get more seconds. */
+    return pick_weighted(hosts, up, total, ((apr_uint64_t) time(NULL)) % weights);
+} /* choose_host_by_time */
+
+
+/* returns an index into cfg->offload_hosts, or -1 if none are usable. */
+static int choose_host(const offload_dir_config *cfg, const request_rec *r)
+{
+    switch (cfg->offload_balance)
+    {
+        case OFFLOAD_BALANCE_HASH:
+            return choose_host_by_hash(cfg, r);
+
+        case OFFLOAD_BALANCE_LOAD:
+        {
+            const int retval = choose_host_by_load(cfg, r);
+            if (retval >= 0)
+                return retval;
+            break;  /* no load data, so fall back to Time. */
+        } /* case */
+
+        case OFFLOAD_BALANCE_TIME:
+        default:
+            break;
+    } /* switch */
+
+    return choose_host_by_time(cfg, r);
+} /* choose_host */
+
+
+static void hmac_sha1(const char *key, const char *data,
+                      unsigned char digest[APR_SHA1_DIGESTSIZE])
+{
+    const size_t keylen = strlen(key);
+    unsigned char inner[APR_SHA1_DIGESTSIZE];
+    unsigned char keybuf[64];
+    char pad[64];
+    apr_sha1_ctx_t sha1;
+    int i;
+
+    memset(keybuf, '\0', sizeof (keybuf));
+    if (keylen <= sizeof (keybuf))
+        memcpy(keybuf, key, keylen);
+    else
+    {
+        apr_sha1_init(&sha1);
+        apr_sha1_update(&sha1, key, (unsigned int) keylen);
+        apr_sha1_final(keybuf, &sha1);
+    } /* else */
+
+    for (i = 0; i < sizeof (pad); i++)
+        pad[i] = (char) (keybuf[i] ^ 0x36);
+    apr_sha1_init(&sha1);
+    apr_sha1_update(&sha1, pad, sizeof (pad));
+    apr_sha1_update(&sha1, data, (unsigned int) strlen(data));
+    apr_sha1_final(inner, &sha1);
+
+    for (i = 0; i < sizeof (pad); i++)
+        pad[i] = (char) (keybuf[i] ^ 0x5C);
+    apr_sha1_init(&sha1);
+    apr_sha1_update(&sha1, pad, sizeof (pad));
+    apr_sha1_update(&sha1, (const char *) inner, sizeof (inner));
+    apr_sha1_final(digest, &sha1);
+} /* hmac_sha1 */
+
+
+static char *hexstr(apr_pool_t *p, const unsigned char *data, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    char *retval = (char *) apr_palloc(p, (len * 2) + 1);
+    size_t i;
+    for (i = 0; i < len; i++)
+    {
+        retval[i*2] = hex[data[i] >> 4];
+        retval[i*2+1] = hex[data[i] & 0xF];
+    } /* for */
+    retval[len * 2] = '\0';
+    return retval;
+} /* hexstr */
+
+
+/*
+ * A token for the offload server that vouches for the ETag, size and
+ *  Last-Modified time it would get from us for this URI right now, so if
+ *  it has that version cached, it doesn't have to ask. It's
+ *  "expiry.length.mtime.etag-in-hex.hmac", signed with OffloadTokenSecret
+ *  over the URI, a newline, and everything before the HMAC.
+ */
+static char *make_token(request_rec *r, const offload_dir_config *cfg)
+{
+    unsigned char digest[APR_SHA1_DIGESTSIZE];
+    const char *etag = NULL;
+    char *signedpart = NULL;
+    char buf[128];
+
+    /* the same ETag and Last-Modified the default handler would send. */
+    ap_update_mtime(r, FINFO_MTIME(r));
+    ap_rationalize_mtime(r, r->mtime);
+    etag = ap_make_etag(r, 0);
+    if ((etag == NULL) || (*etag == '\0'))
+        return NULL;
+
+    snprintf(buf, sizeof (buf), "%llu.%llu.%llu.",
+             (unsigned long long) (REQ_TIME_SECS(r) + cfg->offload_token_lifetime),
+             (unsigned long long) FINFO_SIZE(r),
+             (unsigned long long) REQ_MTIME_SECS(r));
+    signedpart = apr_pstrcat(r->pool, buf,
+                    hexstr(r->pool, (const unsigned char *) etag, strlen(etag)),
+                    NULL);
+
+    hmac_sha1(cfg->offload_token_secret,
+              apr_pstrcat(r->pool, r->unparsed_uri, "\n", signedpart, NULL),
+              digest);
+
+    return apr_pstrcat(r->pool, signedpart, ".",
+                       hexstr(r->pool, digest, OFFLOAD_TOKEN_MACLEN), NULL);
+} /* make_token */
 
 
 static int offload_handler(request_rec *r)
 {
     int i = 0;
-    apr_sockaddr_t *list = NULL;
     offload_dir_config *cfg = NULL;
     char *uri = NULL;
     int nelts = 0;
     int idx = 0;
-    char *offload_host = NULL;
+    const char *offload_host = NULL;
     const char *user_agent = NULL;
     const char *bypass = NULL;
+    const char *pattern = NULL;
 
     cfg = (offload_dir_config *) ap_get_module_config(r->per_dir_config,
                                                       &offload_module);
@@ -259,46 +1608,52 @@ static int offload_handler(request_rec *r)
     } /* if */
 
     /* is this client's IP excluded from offloading? DECLINED */
-    if (cfg->offload_exclude_addr->nelts)
+    if (cfg->offload_exclude_cidrs->nelts)
     {
-        char ipstr[256];
-        #if TARGET_APACHE_1_3
-        unsigned int x = (unsigned int) r->connection->remote_addr.sin_addr.s_addr;
-        snprintf(ipstr, sizeof (ipstr), "%u.%u.%u.%u",
-                 x & 0xFF, (x >> 8) & 0xFF, (x >> 16) & 0xFF, (x >> 24) & 0xFF);
-        #else
-        apr_sockaddr_ip_getbuf(ipstr, sizeof (ipstr), r->connection->remote_addr);
-        #endif
-        for (i = 0; i < cfg->offload_exclude_addr->nelts; i++)
+        const offload_cidr *cidrs = (const offload_cidr *) cfg->offload_exclude_cidrs->elts;
+        unsigned char addr[16];
+        const int family = client_addr_bytes(r, addr);
+        for (i = 0; i < cfg->offload_exclude_cidrs->nelts; i++)
         {
-            char *ip = ((char **) cfg->offload_exclude_addr->elts)[i];
-            if (wild_match(ip, ipstr))
+            if (cidr_match(&cidrs[i], family, addr))
             {
                 debugLog(r, cfg,
-                    "URI request '%s' from address '%s' is excluded from"
-                    " offloading by address pattern '%s'",
-                    r->unparsed_uri, ipstr, ip);
+                    "URI request '%s' is excluded from offloading by"
+                    " address pattern '%s'", r->unparsed_uri,
+                    cidrs[i].pattern);
                 return DECLINED;
             } /* if */
         } /* for */
     } /* if */
 
-    /* is this request from one of the listed offload servers? DECLINED */
-    list = (apr_sockaddr_t *) cfg->offload_ips->elts;
-    for (i = 0; i < cfg->offload_ips->nelts; i++) {
+    if (!matcher_empty(&cfg->offload_exclude_addr))
+    {
+        char ipstr[256];
         #if TARGET_APACHE_1_3
-        int match=(r->connection->remote_addr.sin_addr.s_addr==list[i].s_addr);
+        unsigned int x = (unsigned int) r->connection->remote_addr.sin_addr.s_addr;
+        snprintf(ipstr, sizeof (ipstr), "%u.%u.%u.%u",
+                 x & 0xFF, (x >> 8) & 0xFF, (x >> 16) & 0xFF, (x >> 24) & 0xFF);
         #else
-        int match = apr_sockaddr_equal(r->connection->remote_addr, &list[i]);
+        apr_sockaddr_ip_getbuf(ipstr, sizeof (ipstr), r->connection->remote_addr);
         #endif
-        if (match)
+        pattern = matcher_find(&cfg->offload_exclude_addr, ipstr);
+        if (pattern != NULL)
         {
-            offload_host = ((char **) cfg->offload_hosts->elts)[i];
-            debugLog(r, cfg, "Offload server (%s) doing cache refresh on '%s'",
-                        offload_host, r->unparsed_uri);
+            debugLog(r, cfg,
+                "URI request '%s' from address '%s' is excluded from"
+                " offloading by address pattern '%s'",
+                r->unparsed_uri, ipstr, pattern);
             return DECLINED;
         } /* if */
-    } /* for */
+    } /* if */
+
+    /* is this request from one of the listed offload servers? DECLINED */
+    offload_host = request_from_offload_host(cfg, r);
+    if (offload_host != NULL) {
+        debugLog(r, cfg, "Offload server (%s) doing cache refresh on '%s'",
+                    offload_host, r->unparsed_uri);
+        return DECLINED;
+    } /* if */
 
     /* Is this an explicit request to bypass offloading? DECLINED */
     bypass = (const char *) apr_table_get(r->headers_in, "X-Mod-Offload-Bypass");
@@ -309,48 +1664,67 @@ static int offload_handler(request_rec *r)
     } /* if */
 
     /* is the file in the list of mimetypes to never offload? DECLINED */
-    if ((r->content_type) && (cfg->offload_exclude_mime->nelts))
+    if (r->content_type)
     {
-        for (i = 0; i < cfg->offload_exclude_mime->nelts; i++)
+        pattern = matcher_find(&cfg->offload_exclude_mime, r->content_type);
+        if (pattern != NULL)
         {
-            char *mimetype = ((char **) cfg->offload_exclude_mime->elts)[i];
-            if (wild_match(mimetype, r->content_type))
-            {
-                debugLog(r, cfg,
-                    "URI '%s' (%s) is excluded from offloading"
-                    " by mimetype pattern '%s'", r->unparsed_uri,
-                    r->content_type, mimetype);
-                return DECLINED;
-            } /* if */
-        } /* for */
+            debugLog(r, cfg,
+                "URI '%s' (%s) is excluded from offloading"
+                " by mimetype pattern '%s'", r->unparsed_uri,
+                r->content_type, pattern);
+            return DECLINED;
+        } /* if */
     } /* if */
 
     /* is this User-Agent excluded from offloading (like Google)? DECLINED */
     user_agent = (const char *) apr_table_get(r->headers_in, "User-Agent");
-    if ((user_agent) && (cfg->offload_exclude_agents->nelts))
+    if (user_agent)
     {
-        for (i = 0; i < cfg->offload_exclude_agents->nelts; i++)
+        pattern = matcher_find(&cfg->offload_exclude_agents, user_agent);
+        if (pattern != NULL)
         {
-            char *agent = ((char **) cfg->offload_exclude_agents->elts)[i];
-            if (wild_match(agent, user_agent))
-            {
-                debugLog(r, cfg,
-                    "URI request '%s' from agent '%s' is excluded from"
-                    " offloading by User-Agent pattern '%s'",
-                    r->unparsed_uri, user_agent, agent);
-                return DECLINED;
-            } /* if */
-        } /* for */
+            debugLog(r, cfg,
+                "URI request '%s' from agent '%s' is excluded from"
+                " offloading by User-Agent pattern '%s'",
+                r->unparsed_uri, user_agent, pattern);
+            return DECLINED;
+        } /* if */
+    } /* if */
+
+    #if OFFLOAD_SHM_SUPPORTED
+    /* is this file too rarely requested to be worth caching? DECLINED */
+    if ((cfg->offload_min_popularity > 1) && (offload_popularity != NULL))
+    {
+        const apr_uint32_t count = count_popularity(r);
+        if (count < (apr_uint32_t) cfg->offload_min_popularity) {
+            debugLog(r, cfg, "URI '%s' not popular enough (requested about"
+                     " %u times, need %d)", r->unparsed_uri,
+                     (unsigned int) count, cfg->offload_min_popularity);
+            return DECLINED;
+        } /* if */
     } /* if */
+    #endif
 
-    /* We can offload this. Pick a random offload servers from defined list. */
+    /* We can offload this. Pick an offload server from defined list. */
     debugLog(r, cfg, "Offloading URI '%s'", r->unparsed_uri);
-    idx = (int)(time(NULL) % nelts);
-    offload_host = ((char **) cfg->offload_hosts->elts)[idx];
+    idx = choose_host(cfg, r);
+    if (idx < 0) {
+        debugLog(r, cfg, "No offload hosts are up; serving '%s' ourselves",
+                 r->unparsed_uri);
+        return DECLINED;
+    } /* if */
+    offload_host = ((offload_host_rec *) cfg->offload_hosts->elts)[idx].name;
     debugLog(r, cfg, "Chose server #%d (%s)", idx, offload_host);
 
     /* Offload it: set a "Location:" header and 302 redirect. */
     uri = apr_pstrcat(r->pool, "http://", offload_host, r->unparsed_uri, NULL);
+    if (cfg->offload_token_secret != NULL)
+    {
+        const char *token = make_token(r, cfg);
+        if (token != NULL)
+            uri = apr_pstrcat(r->pool, uri, "?" OFFLOAD_TOKEN_PARAM "=", token, NULL);
+    } /* if */
     debugLog(r, cfg, "Redirect from '%s' to '%s'", r->unparsed_uri, uri);
 
     apr_table_setn(r->headers_out, "Location", uri);
@@ -365,17 +1739,36 @@ static void *create_offload_dir_config(apr_pool_t *p, char *dummy)
 
     retval->offload_engine_on = 0;
     retval->offload_debug = 0;
-    retval->offload_hosts = apr_array_make(p, 0, sizeof (char *));
-    retval->offload_exclude_mime = apr_array_make(p, 0, sizeof (char *));
-    retval->offload_exclude_agents = apr_array_make(p, 0, sizeof (char *));
-    retval->offload_exclude_addr = apr_array_make(p, 0, sizeof (char *));
-    retval->offload_ips = apr_array_make(p, 0, sizeof (apr_sockaddr_t));
+    retval->offload_balance = OFFLOAD_BALANCE_TIME;
+    retval->offload_hosts = apr_array_make(p, 0, sizeof (offload_host_rec));
+    matcher_init(&retval->offload_exclude_mime, p);
+    matcher_init(&retval->offload_exclude_agents, p);
+    matcher_init(&retval->offload_exclude_addr, p);
+    retval->offload_exclude_cidrs = apr_array_make(p, 0, sizeof (offload_cidr));
+    retval->offload_addrs = NULL;
     retval->offload_min_size = DEFAULT_MIN_OFFLOAD_SIZE;
+    retval->offload_min_popularity = 0;
+    retval->offload_token_secret = NULL;
+    retval->offload_token_lifetime = DEFAULT_TOKEN_LIFETIME;
     
     return retval;
 } /* create_offload_dir_config */
 
 
+static void *create_offload_server_config(apr_pool_t *p, server_rec *s)
+{
+    offload_server_config *retval =
+      (offload_server_config *) apr_palloc(p, sizeof (offload_server_config));
+
+    retval->health_uri = NULL;
+    retval->health_interval = DEFAULT_HEALTH_INTERVAL;
+    retval->health_failures = DEFAULT_HEALTH_FAILURES;
+    retval->popularity_window = DEFAULT_POPULARITY_WINDOW;
+
+    return retval;
+} /* create_offload_server_config */
+
+
 static const char *offload_engine(cmd_parms *parms, void *mconfig, int flag)
 {
     offload_dir_config *cfg = (offload_dir_config *) mconfig;
@@ -393,38 +1786,95 @@ static const char *offload_debug(cmd_parms *parms, void *mconfig, int flag)
 
 
 static const char *offload_host(cmd_parms *parms, void *mconfig,
-                                const char *_arg)
+                                const char *_arg, const char *weightstr)
 {
     offload_dir_config *cfg = (offload_dir_config *) mconfig;
-    char **hostelem = (char **) apr_array_push(cfg->offload_hosts);
-    apr_sockaddr_t *addr = (apr_sockaddr_t *) apr_array_push(cfg->offload_ips);
+    offload_host_rec *hostelem = NULL;
+    const char *name = NULL;
+    char *host = NULL;
     char *ptr = NULL;
     char arg[512];
+    long weight = DEFAULT_HOST_WEIGHT;
+
+    if (weightstr != NULL)
+    {
+        weight = strtol(weightstr, &ptr, 10);
+        if ((*ptr != '\0') || (weight <= 0) || (weight > MAX_HOST_WEIGHT))
+            return "OffloadHost weight must be a number from 1 to 10000";
+    } /* if */
 
     apr_cpystrn(arg, _arg, sizeof (arg));
-    ptr = strchr(arg, ':');
-    if (ptr != NULL)
-        *ptr = '\0';   /* chop off port number if it's there. */
+    host = arg;
+    if (*host == '[')  /* "[2001:db8::1]:8080" */
+    {
+        host++;
+        ptr = strchr(host, ']');
+        if (ptr == NULL)
+            return "OffloadHost has a '[' without a matching ']'";
+        *ptr = '\0';
+    } /* if */
+    else
+    {
+        ptr = strchr(host, ':');
+        if (ptr != NULL)
+            *ptr = '\0';   /* chop off port number if it's there. */
+    } /* else */
+
+    /* remember every address it resolves to, for multi-homed hosts. */
+    name = apr_pstrdup(parms->pool, _arg);
 
     #if TARGET_APACHE_1_3
-    struct hostent *hp = ap_pgethostbyname(parms->pool, arg);
-    if (hp == NULL)
-        return "DNS lookup failure!";
-    memcpy(addr, (apr_sockaddr_t *) (hp->h_addr), sizeof (apr_sockaddr_t));
+    {
+        struct hostent *hp = ap_pgethostbyname(parms->pool, host);
+        char **addrs;
+        if (hp == NULL)
+            return "DNS lookup failure!";
+        for (addrs = hp->h_addr_list; *addrs != NULL; addrs++)
+        {
+            if (hp->h_addrtype == AF_INET)
+                addrset_add(cfg, parms->pool, AF_INET, (const unsigned char *) *addrs, name);
+        } /* for */
+    }
     #else
-    apr_sockaddr_t *resolved = NULL;
-    apr_status_t rc;
-    rc = apr_sockaddr_info_get(&resolved, arg, APR_UNSPEC, 0, 0, parms->pool);
-    if (rc != APR_SUCCESS)
-        return "DNS lookup failure!";
-    memcpy(addr, resolved, sizeof (apr_sockaddr_t));
+    {
+        apr_sockaddr_t *resolved = NULL;
+        apr_status_t rc;
+        rc = apr_sockaddr_info_get(&resolved, host, APR_UNSPEC, 0, 0, parms->pool);
+        if (rc != APR_SUCCESS)
+            return "DNS lookup failure!";
+        for (; resolved != NULL; resolved = resolved->next)
+        {
+            unsigned char addr[16];
+            const int family = sockaddr_bytes(resolved, addr);
+            addrset_add(cfg, parms->pool, family, addr, name);
+        } /* for */
+    }
     #endif
 
-    *hostelem = apr_pstrdup(parms->pool, _arg);
+    hostelem = (offload_host_rec *) apr_array_push(cfg->offload_hosts);
+    hostelem->name = name;
+    hostelem->hash = offload_mix(offload_hash(hostelem->name, 0));
+    hostelem->weight = (unsigned int) weight;
     return NULL;  /* no error. */
 } /* offload_host */
 
 
+static const char *offload_balance(cmd_parms *parms, void *mconfig,
+                                   const char *arg)
+{
+    offload_dir_config *cfg = (offload_dir_config *) mconfig;
+    if (strcasecmp(arg, "Time") == 0)
+        cfg->offload_balance = OFFLOAD_BALANCE_TIME;
+    else if (strcasecmp(arg, "Hash") == 0)
+        cfg->offload_balance = OFFLOAD_BALANCE_HASH;
+    else if (strcasecmp(arg, "Load") == 0)
+        cfg->offload_balance = OFFLOAD_BALANCE_LOAD;
+    else
+        return "OffloadBalance must be Time, Hash or Load";
+    return NULL;  /* no error. */
+} /* offload_balance */
+
+
 static const char *offload_minsize(cmd_parms *parms, void *mconfig,
                                    const char *arg)
 {
@@ -434,12 +1884,55 @@ static const char *offload_minsize(cmd_parms *parms, void *mconfig,
 } /* offload_minsize */
 
 
+static const char *offload_minpopularity(cmd_parms *parms, void *mconfig,
+                                         const char *arg)
+{
+    offload_dir_config *cfg = (offload_dir_config *) mconfig;
+    cfg->offload_min_popularity = atoi(arg);
+    if (cfg->offload_min_popularity < 0)
+        return "OffloadMinPopularity can't be negative";
+    return NULL;  /* no error. */
+} /* offload_minpopularity */
+
+
+#if OFFLOAD_SHM_SUPPORTED
+static const char *offload_popularitywindow(cmd_parms *parms, void *mconfig,
+                                            const char *arg)
+{
+    offload_server_config *scfg = get_server_config(parms->server);
+    scfg->popularity_window = atoi(arg);
+    if (scfg->popularity_window <= 0)
+        return "OffloadPopularityWindow must be more than zero";
+    return NULL;  /* no error. */
+} /* offload_popularitywindow */
+#endif
+
+
+static const char *offload_tokensecret(cmd_parms *parms, void *mconfig,
+                                       const char *arg)
+{
+    offload_dir_config *cfg = (offload_dir_config *) mconfig;
+    cfg->offload_token_secret = (*arg) ? apr_pstrdup(parms->pool, arg) : NULL;
+    return NULL;  /* no error. */
+} /* offload_tokensecret */
+
+
+static const char *offload_tokenlifetime(cmd_parms *parms, void *mconfig,
+                                         const char *arg)
+{
+    offload_dir_config *cfg = (offload_dir_config *) mconfig;
+    cfg->offload_token_lifetime = atoi(arg);
+    if (cfg->offload_token_lifetime <= 0)
+        return "OffloadTokenLifetime must be more than zero";
+    return NULL;  /* no error. */
+} /* offload_tokenlifetime */
+
+
 static const char *offload_excludemime(cmd_parms *parms, void *mconfig,
                                        const char *arg)
 {
     offload_dir_config *cfg = (offload_dir_config *) mconfig;
-    char **mimepattern = (char **) apr_array_push(cfg->offload_exclude_mime);
-    *mimepattern = apr_pstrdup(parms->pool, arg);
+    matcher_add(&cfg->offload_exclude_mime, parms->pool, arg);
     return NULL;  /* no error. */
 } /* offload_excludemime */
 
@@ -448,8 +1941,7 @@ static const char *offload_excludeagent(cmd_parms *parms, void *mconfig,
                                         const char *arg)
 {
     offload_dir_config *cfg = (offload_dir_config *) mconfig;
-    char **agentpattern = (char **) apr_array_push(cfg->offload_exclude_agents);
-    *agentpattern = apr_pstrdup(parms->pool, arg);
+    matcher_add(&cfg->offload_exclude_agents, parms->pool, arg);
     return NULL;  /* no error. */
 } /* offload_excludeagent */
 
@@ -458,28 +1950,91 @@ static const char *offload_excludeaddr(cmd_parms *parms, void *mconfig,
                                        const char *arg)
 {
     offload_dir_config *cfg = (offload_dir_config *) mconfig;
-    char **addrpattern = (char **) apr_array_push(cfg->offload_exclude_addr);
-    *addrpattern = apr_pstrdup(parms->pool, arg);
+    offload_cidr cidr;
+    if (parse_cidr(arg, &cidr))
+    {
+        cidr.pattern = apr_pstrdup(parms->pool, arg);
+        memcpy(apr_array_push(cfg->offload_exclude_cidrs), &cidr, sizeof (cidr));
+    } /* if */
+    else  /* not an address; match it against the address as a string. */
+    {
+        matcher_add(&cfg->offload_exclude_addr, parms->pool, arg);
+    } /* else */
     return NULL;  /* no error. */
 } /* offload_excludeaddr */
 
 
+#if OFFLOAD_HEALTH_SUPPORTED
+static const char *offload_healthcheck(cmd_parms *parms, void *mconfig,
+                                       const char *arg)
+{
+    offload_server_config *scfg = get_server_config(parms->server);
+    if (*arg != '/')
+        return "OffloadHealthCheck must be a path starting with '/'";
+    scfg->health_uri = apr_pstrdup(parms->pool, arg);
+    return NULL;  /* no error. */
+} /* offload_healthcheck */
+
+
+static const char *offload_healthinterval(cmd_parms *parms, void *mconfig,
+                                          const char *arg)
+{
+    offload_server_config *scfg = get_server_config(parms->server);
+    scfg->health_interval = atoi(arg);
+    if (scfg->health_interval <= 0)
+        return "OffloadHealthInterval must be more than zero";
+    return NULL;  /* no error. */
+} /* offload_healthinterval */
+
+
+static const char *offload_healthfailures(cmd_parms *parms, void *mconfig,
+                                          const char *arg)
+{
+    offload_server_config *scfg = get_server_config(parms->server);
+    scfg->health_failures = atoi(arg);
+    if (scfg->health_failures <= 0)
+        return "OffloadHealthFailures must be more than zero";
+    return NULL;  /* no error. */
+} /* offload_healthfailures */
+#endif
+
+
 static const command_rec offload_cmds[] =
 {
     AP_INIT_FLAG("OffloadEngine", offload_engine, NULL, OR_OPTIONS,
       "Set to On or Off to enable or disable offloading"),
     AP_INIT_FLAG("OffloadDebug", offload_debug, NULL, OR_OPTIONS,
       "Set to On or Off to enable or disable debug spam to error log"),
-    AP_INIT_TAKE1("OffloadHost", offload_host, NULL, OR_OPTIONS,
-      "Hostname or IP address of offload server"),
+    AP_INIT_TAKE12("OffloadHost", offload_host, NULL, OR_OPTIONS,
+      "Hostname or IP address of offload server, and an optional weight"),
+    AP_INIT_TAKE1("OffloadBalance", offload_balance, NULL, OR_OPTIONS,
+      "How to choose an offload server: Time, Hash or Load"),
     AP_INIT_TAKE1("OffloadMinSize", offload_minsize, NULL, OR_OPTIONS,
       "Minimum size, in bytes, that a file must be to be offloaded"),
+    AP_INIT_TAKE1("OffloadMinPopularity",offload_minpopularity,0,OR_OPTIONS,
+      "Requests in OffloadPopularityWindow before a file is offloaded"),
+#if OFFLOAD_SHM_SUPPORTED
+    AP_INIT_TAKE1("OffloadPopularityWindow",offload_popularitywindow,0,RSRC_CONF,
+      "Seconds of requests that OffloadMinPopularity counts"),
+#endif
+    AP_INIT_TAKE1("OffloadTokenSecret",offload_tokensecret,0,RSRC_CONF|ACCESS_CONF,
+      "Secret shared with offload servers to sign redirects with"),
+    AP_INIT_TAKE1("OffloadTokenLifetime",offload_tokenlifetime,0,OR_OPTIONS,
+      "Seconds that a signed redirect is good for"),
     AP_INIT_TAKE1("OffloadExcludeMimeType",offload_excludemime,0,OR_OPTIONS,
       "Mimetype to always exclude from offloading (wildcards allowed)"),
     AP_INIT_TAKE1("OffloadExcludeUserAgent",offload_excludeagent,0,OR_OPTIONS,
       "User-Agent to always exclude from offloading (wildcards allowed)"),
     AP_INIT_TAKE1("OffloadExcludeAddress",offload_excludeaddr,0,OR_OPTIONS,
-      "IP address to always exclude from offloading (wildcards allowed)"),
+      "IP address or CIDR block to always exclude from offloading"),
+#if OFFLOAD_HEALTH_SUPPORTED
+    AP_INIT_TAKE1("OffloadHealthCheck",offload_healthcheck,0,RSRC_CONF,
+      "URI to HEAD on each offload host to see if it's still alive"),
+    AP_INIT_TAKE1("OffloadHealthInterval",offload_healthinterval,0,RSRC_CONF,
+      "Seconds between health checks of each offload host"),
+    AP_INIT_TAKE1("OffloadHealthFailures",offload_healthfailures,0,RSRC_CONF,
+      "Failed health checks in a row before an offload host is skipped"),
+#endif
     { NULL }
 };
 
@@ -505,7 +2060,7 @@ module MODULE_VAR_EXPORT offload_module =
     init_offload,               /* module initializer                 */
     create_offload_dir_config,  /* per-directory config creator       */
     NULL,                       /* dir config merger                  */
-    NULL,                       /* server config creator              */
+    create_offload_server_config, /* server config creator            */
     NULL,                       /* server config merger               */
     offload_cmds,               /* command table                      */
     offload_handlers,           /* [9]  content handlers              */
@@ -528,12 +2083,78 @@ int offload_init(apr_pool_t *p, apr_pool_t *plog, apr_pool_t *ptemp,
                  server_rec *base_server)
 {
     ap_add_version_component(p, VERSION_COMPONENT);
+
+    #if OFFLOAD_HEALTH_SUPPORTED
+    offload_shm = NULL;
+    offload_shared = NULL;
+    if (get_server_config(base_server)->health_uri != NULL)
+    {
+        /* anonymous shared memory; children inherit it across fork(). */
+        const apr_size_t len = sizeof (offload_shared_data);
+        if (apr_shm_create(&offload_shm, len, NULL, p) != APR_SUCCESS)
+        {
+            ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, base_server,
+                         "mod_offload: couldn't create shared memory;"
+                         " health checks are disabled.");
+            offload_shm = NULL;
+        } /* if */
+        else
+        {
+            offload_shared = (offload_shared_data *) apr_shm_baseaddr_get(offload_shm);
+            memset(offload_shared, '\0', len);
+        } /* else */
+    } /* if */
+    #endif
+
+    #if OFFLOAD_SHM_SUPPORTED
+    offload_popularity_shm = NULL;
+    offload_popularity = NULL;
+    offload_popularity_window = get_server_config(base_server)->popularity_window;
+    {
+        const apr_size_t len = sizeof (offload_popularity_data);
+        if (apr_shm_create(&offload_popularity_shm, len, NULL, p) != APR_SUCCESS)
+        {
+            ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, base_server,
+                         "mod_offload: couldn't create shared memory;"
+                         " OffloadMinPopularity is disabled.");
+            offload_popularity_shm = NULL;
+        } /* if */
+        else
+        {
+            offload_popularity = (offload_popularity_data *) apr_shm_baseaddr_get(offload_popularity_shm);
+            memset(offload_popularity, '\0', len);
+        } /* else */
+    }
+    #endif
+
     return OK;
 } /* init_offload */
 
+#if OFFLOAD_HEALTH_SUPPORTED
+static void offload_child_init(apr_pool_t *p, server_rec *s)
+{
+    apr_threadattr_t *attr = NULL;
+    apr_thread_t *thread = NULL;
+
+    if (offload_shared == NULL)
+        return;  /* health checks are disabled. */
+
+    if ( (apr_threadattr_create(&attr, p) != APR_SUCCESS) ||
+         (apr_threadattr_detach_set(attr, 1) != APR_SUCCESS) ||
+         (apr_thread_create(&thread, attr, health_thread, s, p) != APR_SUCCESS) )
+    {
+        ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, s,
+                     "mod_offload: couldn't start health check thread.");
+    } /* if */
+} /* offload_child_init */
+#endif
+
 static void offload_register_hooks(apr_pool_t *p)
 {
     ap_hook_post_config(offload_init, NULL, NULL, APR_HOOK_MIDDLE);
+    #if OFFLOAD_HEALTH_SUPPORTED
+    ap_hook_child_init(offload_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+    #endif
     ap_hook_handler(offload_handler, NULL, NULL, APR_HOOK_LAST);
 } /* offload_register_hooks */
 
@@ -542,7 +2163,7 @@ module AP_MODULE_DECLARE_DATA offload_module =
     STANDARD20_MODULE_STUFF,
     create_offload_dir_config,  /* create per-directory config structures */
     NULL,                       /* merge per-directory config structures  */
-    NULL,                       /* create per-server config structures    */
+    create_offload_server_config, /* create per-server config structures  */
     NULL,                       /* merge per-server config structures     */
     offload_cmds,               /* command handlers */
     offload_register_hooks      /* register hooks */
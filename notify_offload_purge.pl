@@ -0,0 +1,138 @@
+#!/usr/bin/perl -w
+
+# Tell offload servers that files on the base server changed, so they drop
+#  their cached copies now instead of waiting for their next HEAD request.
+#  The offload servers need GPURGESECRET set to the same secret.
+#
+# You can list URIs on the command line, or feed them on stdin, one per line.
+#  With --docroot, you can give file paths instead, which makes it easy to
+#  hook up to something that watches the filesystem, like:
+#
+#  inotifywait -m -r -e close_write,moved_to,delete --format '%w%f' /var/www \
+#    | ./notify_offload_purge.pl --secretfile=/etc/offload-secret \
+#        --docroot=/var/www offload1.example.com offload2.example.com
+#
+# With --prefetch, the offload servers pull the files into their caches
+#  right away instead, so a new release is already there when the first
+#  downloads show up. --minsize skips small files (needs --docroot, so we
+#  can see how big they are). Offload servers that are already busy
+#  prefetching tell us to wait, so we try them again later.
+
+use warnings;
+use strict;
+
+# unbuffered output.
+$| = 1;
+
+require LWP;
+require LWP::UserAgent;
+require HTTP::Request;
+use Digest::SHA qw(hmac_sha1_hex);
+
+my $ua = new LWP::UserAgent;  # we create a global UserAgent object
+$ua->timeout(10);
+
+# purge requests are only good for this many seconds, so they can't be replayed later.
+my $lifetime = 60;
+
+sub usage {
+    die("USAGE: $0 --secretfile=FILE [--docroot=DIR] [--etag=ETAG] [--prefetch [--minsize=BYTES]] <offloadhost> [<offloadhost> ...] [-- <uri> ...]\n");
+}
+
+my $secretfile = undef;
+my $docroot = undef;
+my $etag = '';
+my $prefetch = 0;
+my $minsize = 0;
+my @hosts = ();
+my @uris = ();
+my $seendashes = 0;
+foreach (@ARGV) {
+    push(@uris, $_), next if ($seendashes);
+    $seendashes = 1, next if ($_ eq '--');
+    $secretfile = $1, next if (/\A--secretfile=(.+)\Z/);
+    $docroot = $1, next if (/\A--docroot=(.+)\Z/);
+    $etag = $1, next if (/\A--etag=(.+)\Z/);
+    $prefetch = 1, next if ($_ eq '--prefetch');
+    $minsize = $1, next if (/\A--minsize=(\d+)\Z/);
+    usage() if (/\A--/);
+    push(@hosts, $_);
+}
+
+usage() if ((not defined $secretfile) || (not @hosts));
+usage() if (($minsize > 0) && ((not $prefetch) || (not defined $docroot)));
+
+open(SECRETH, '<', $secretfile) || die("Couldn't open [$secretfile]: $!\n");
+my $secret = <SECRETH>;
+close(SECRETH);
+die("No secret in [$secretfile]\n") if (not defined $secret);
+chomp($secret);
+
+$docroot =~ s/\/+\Z// if (defined $docroot);
+
+sub toUri {
+    my $str = shift;
+    if (defined $docroot) {
+        return undef if (index($str, "$docroot/") != 0);
+        $str = substr($str, length($docroot));
+        $str =~ s/([^A-Za-z0-9\-\._~\/])/sprintf("%%%02X", ord($1))/ge;
+    }
+    return ($str =~ /\A\//) ? $str : undef;
+}
+
+sub signedRequest {
+    my ($method, $host, $uri, $etag, $authheader) = @_;
+    my $expiry = time() + $lifetime;
+    my $mac = substr(hmac_sha1_hex("$method\n$uri\n$etag\n$expiry", $secret), 0, 32);
+    my $request = HTTP::Request->new($method => "http://$host$uri");
+    $request->header($authheader => "$expiry.$mac");
+    $request->header('X-Offload-ETag' => $etag) if ($etag ne '');
+    return $ua->request($request);
+}
+
+sub report {
+    my ($host, $uri, $response) = @_;
+    my $content = $response->content();
+    $content =~ s/\s+\Z//;
+    if ($response->is_success()) {
+        print(" - $host$uri: $content\n");
+    } else {
+        print(" - $host$uri: FAILED (" . $response->status_line() . ")\n");
+    }
+}
+
+sub purge {
+    my $path = shift;
+    my $uri = toUri($path);
+    return if (not defined $uri);
+
+    if (not $prefetch) {
+        report($_, $uri, signedRequest('PURGE', $_, $uri, $etag, 'X-Offload-Purge')) foreach (@hosts);
+        return;
+    }
+
+    return if (($minsize > 0) && ((not -f $path) || ((-s $path) < $minsize)));
+
+    # each host only runs a few prefetches at once; wait our turn.
+    foreach (@hosts) {
+        my $host = $_;
+        my $response;
+        for (my $tries = 0; $tries < 60; $tries++) {
+            $response = signedRequest('PREFETCH', $host, $uri, '', 'X-Offload-Prefetch');
+            last if (($response->code() != 503) || ($response->content() !~ /try again later/));
+            sleep(10);
+        }
+        report($host, $uri, $response);
+    }
+}
+
+if (@uris) {
+    purge($_) foreach (@uris);
+} else {
+    while (<STDIN>) {
+        chomp;
+        purge($_) if ($_ ne '');
+    }
+}
+
+exit 0;
@@ -19,6 +19,32 @@
 #define GDEBUGDIR "/usr/local/apache/logs"
 #endif
 
+// Set this to a filename (a full path!) to read settings from when we start
+//  up, so you can tune a server without rebuilding it. The values in this
+//  header are the defaults. Each line is a setting named like its #define,
+//  and its value, like this:
+//     GTIMEOUT 30
+//     GOFFLOADDIR /var/cache/offload
+//     GPURGESECRET NULL
+// Lines starting with '#' are comments. As a daemon, we read it again when
+//  we get SIGHUP; new connections use the new settings, and transfers in
+//  progress aren't interrupted. If the file has an error, we refuse to start
+//  (or keep the old settings, on SIGHUP).
+// These can go in the file: GBASESERVER, GBASESERVERIP, GBASESERVERPORT,
+//  GTIMEOUT, GOFFLOADDIR, GMAXDUPEDOWNLOADS, GLOGFILE, GLOGFLUSHSECS,
+//  GSTATUSURI, GMETRICSURI, GTOKENSECRET, GPURGESECRET, GREVALIDATETTL,
+//  GPREFETCHSECRET, GPREFETCHMINSIZE, GPREFETCHRATE, GPREFETCHMAXFILLS,
+//  GPEERTIMEOUTMS, GPARENTTIMEOUTMS, GORIGINS, GCACHEMAXBYTES,
+//  GCACHESCANSECS, GMAXCLIENTCONNS, GCLIENTRATE, GCLIENTBURST,
+//  GEGRESSRATE, GNOTSENTLOWAT, GPACINGRATE, GHEADERTIMEOUT, GMINSENDRATE
+//  and GMINSENDWINDOW. The rest change what gets built, so they stay here.
+//  GMAXDUPEDOWNLOADS and the logging settings only matter if they're turned
+//  on here.
+// NULL means there's no config file.
+#ifndef GCONFIGFILE
+#define GCONFIGFILE NULL
+#endif
+
 // Set this to non-zero to provide a listen server that serves HTTP requests
 //  directly. Set this to zero and you need to run as a cgi-bin program
 //  through another webserver. Obviously, you can't listen on port 80 if
@@ -50,8 +76,74 @@
 #define GLISTENTRUSTFWD "127.0.0.1", "0.0.0.0"
 #endif
 
+// Ignore this if GLISTENPORT == 0.
+// Set GNOTSENTLOWAT to the most bytes we let sit unsent in the kernel for
+//  each client (Linux's TCP_NOTSENT_LOWAT). Without it, the kernel queues
+//  up as much as the socket buffer holds, which is megabytes per slow
+//  client, and it goes out in big bursts. With it, we wait for the
+//  client to catch up before writing more.
+// Set this to zero to leave it up to the kernel.
+#ifndef GNOTSENTLOWAT
+#define GNOTSENTLOWAT (128 * 1024)
+#endif
+
+// Ignore this if GLISTENPORT == 0.
+// Set GPACINGRATE to the most bytes per second to send on any one client
+//  connection. The kernel spaces out the packets (SO_MAX_PACING_RATE), so
+//  this costs nothing in userspace, unlike GCLIENTRATE, which also covers
+//  a client's other connections. Peer requests from GPEERS, and anything
+//  from GCHILDREN, aren't paced.
+// Set this to zero to disable it.
+#ifndef GPACINGRATE
+#define GPACINGRATE 0
+#endif
+
+// Ignore this if GLISTENPORT == 0.
+// Set GHEADERTIMEOUT to how many seconds a client gets to send its whole
+//  request (not per byte; all of it). Browsers send it right away, so this
+//  can be short; clients that trickle it in a byte at a time are holding a
+//  process for nothing.
+#ifndef GHEADERTIMEOUT
+#define GHEADERTIMEOUT 10
+#endif
+
+// Ignore this if GLISTENPORT == 0.
+// Set GMAXHEADERCONNS to how many connections can be sending us their
+//  request at once. The daemon parent closes new connections over this
+//  limit (with a 503) instead of forking a process for them, so a flood of
+//  idle connections can't use up memory. Legitimate requests only spend a
+//  moment here, so it's rare to have many of them at once.
+// This sets the size of the shared memory, so it's not in GCONFIGFILE.
+//  Set it to zero to disable it.
+#ifndef GMAXHEADERCONNS
+#define GMAXHEADERCONNS 256
+#endif
+
+// Set GMINSENDRATE to the slowest, in bytes per second, that a client can
+//  take a download, averaged over GMINSENDWINDOW seconds. Slower clients are
+//  disconnected. Time we spend waiting on the base server, a peer, or our own
+//  GCLIENTRATE and GEGRESSRATE limits doesn't count against them, but keep
+//  this well under GPACINGRATE.
+// Set GMINSENDRATE to zero to disable it.
+#ifndef GMINSENDRATE
+#define GMINSENDRATE 1024
+#endif
+
+#ifndef GMINSENDWINDOW
+#define GMINSENDWINDOW 60
+#endif
+
 // Ignore this if GLISTENPORT == 0.
 // Set this to non-zero to make process fork to background on startup.
+// To upgrade a running daemon, replace its binary and send the parent
+//  process SIGUSR2. It starts the new binary (with the same command line,
+//  so run it with a full path) and hands it the listen socket. Once the new
+//  one is up, the old one exits, and transfers in progress finish normally.
+//  If the new one fails to start, the old one keeps going. If the new
+//  binary lays out its shared memory differently, it starts fresh stats
+//  and tables rather than sharing the old one's, and removes the old
+//  ones from /dev/shm once it has taken over. On systems without
+//  /dev/shm, remove the old SHM_NAME segments by hand after an upgrade.
 #ifndef GLISTENDAEMONIZE
 #define GLISTENDAEMONIZE 0
 #endif
@@ -69,6 +161,20 @@
 #define GLOGFILE "/usr/local/apache/logs/access.log"
 #endif
 
+// Ignore this if GLOGACTIVITY == 0 or GLISTENPORT == 0.
+// As a daemon, log lines are collected in shared memory and the parent
+//  process writes them to GLOGFILE in batches. GLOGBUFFERSIZE is how many
+//  bytes to collect (if it fills up, children write their lines directly),
+//  and GLOGFLUSHSECS is how often, in seconds, to write them out. Send the
+//  parent process SIGHUP to make it reopen GLOGFILE (for logrotate, etc).
+#ifndef GLOGBUFFERSIZE
+#define GLOGBUFFERSIZE (64 * 1024)
+#endif
+
+#ifndef GLOGFLUSHSECS
+#define GLOGFLUSHSECS 1
+#endif
+
 // This is the server that you are offloading's hostname.
 #ifndef GBASESERVER
 #define GBASESERVER "example.com"
@@ -114,6 +220,225 @@
 #define GMAXDUPEDOWNLOADS 1
 #endif
 
+// This is how many downloads we can track for GMAXDUPEDOWNLOADS at once.
+//  The table lives in shared memory, at 16 bytes a download, so the default
+//  is 64 kilobytes. Give it a few times more slots than you expect
+//  concurrent downloads; when a busy area of the table fills up, we stop
+//  checking new downloads that land there for dupes until it drains.
+// This sets the size of the shared memory, so it's not in GCONFIGFILE.
+//  It has to be a multiple of 64.
+#ifndef GDUPETABLESIZE
+#define GDUPETABLESIZE 4096
+#endif
+
+// Set GMAXCLIENTCONNS to the number of downloads one IP address can have
+//  going at once, of any files. Downloads over the limit get a 429 Too Many
+//  Requests. Unlike GMAXDUPEDOWNLOADS, this catches one client fetching
+//  fifty different files at the same time. Peer requests from GPEERS, and
+//  anything from GCHILDREN, don't count.
+// Set this to zero to disable it.
+#ifndef GMAXCLIENTCONNS
+#define GMAXCLIENTCONNS 0
+#endif
+
+// Set GCLIENTRATE to the most bytes per second we'll send to one IP
+//  address, shared between all its downloads. A client can send up to
+//  GCLIENTBURST bytes at full speed after it's been idle (or slower than the
+//  limit) for a while; zero means one second's worth of GCLIENTRATE.
+//  Peer requests from GPEERS, and anything from GCHILDREN, aren't limited.
+// Set GCLIENTRATE to zero to disable it.
+#ifndef GCLIENTRATE
+#define GCLIENTRATE 0
+#endif
+
+#ifndef GCLIENTBURST
+#define GCLIENTBURST 0
+#endif
+
+// Set GEGRESSRATE to the most bytes per second this server sends to
+//  clients and peers, all together, so you can leave room on the uplink for
+//  other things. Cache fills from the base server aren't counted. This
+//  works as a CGI, too, but then every request maps the shared memory.
+// Set this to zero to disable it.
+#ifndef GEGRESSRATE
+#define GEGRESSRATE 0
+#endif
+
+// This is how many client addresses we can track for GMAXCLIENTCONNS and
+//  GCLIENTRATE at once. The table lives in shared memory, at 32 bytes an
+//  address, so the default is 128 kilobytes. An address keeps its slot
+//  until it's been idle for a little longer than GTIMEOUT. If a busy area
+//  of the table fills up, new addresses that land there aren't limited
+//  until it drains.
+// This sets the size of the shared memory, so it's not in GCONFIGFILE.
+//  It has to be a multiple of 64.
+#ifndef GCLIENTTABLESIZE
+#define GCLIENTTABLESIZE 4096
+#endif
+
+// Set this to a URL path (like "/offload-status") to have this server answer
+//  requests for it with a plain-text report of its counters (active
+//  connections, cache hits and misses, bytes served, etc) instead of trying
+//  to offload it. The counters live in shared memory, so they cover every
+//  process serving this cache. NULL disables this.
+#ifndef GSTATUSURI
+#define GSTATUSURI NULL
+#endif
+
+// Set this to a URL path (like "/metrics") to have this server answer
+//  requests for it with the same counters in Prometheus text format, plus
+//  latency histograms for each phase of a request (reading the client's
+//  headers, the HEAD to the base server, waiting on the semaphore, loading
+//  metadata, time to first byte, the whole transfer, and cache fills).
+//  NULL disables this.
+#ifndef GMETRICSURI
+#define GMETRICSURI NULL
+#endif
+
+// Ignore this if GSTATUSURI and GMETRICSURI are both NULL.
+// Set this to a list of IP addresses that may see the status report and
+//  metrics, in the same format as GLISTENTRUSTFWD. Everyone else gets a
+//  403 Forbidden.
+#ifndef GSTATUSALLOW
+#define GSTATUSALLOW "127.0.0.1", "::1"
+#endif
+
+// Set this to a secret string, the same one you give mod_offload's
+//  OffloadTokenSecret directive. mod_offload will then add a signed token
+//  to its redirects that vouches for the file's ETag, size and modification
+//  time, so if we already have that exact version cached, we can serve it
+//  without sending a HEAD request to the base server first. Clients with a
+//  missing, expired or bad token just get the usual HEAD request. Keep
+//  this secret; anyone who knows it can make us serve a stale cached copy.
+//  This is ignored if GNOCACHE is enabled. NULL disables this.
+#ifndef GTOKENSECRET
+#define GTOKENSECRET NULL
+#endif
+
+// Set this to a secret string to let the base server tell us when files
+//  change, with notify_offload_purge.pl (give it the same secret). We drop
+//  our cached copy of a file when told, unless we already have the new
+//  version. This is ignored if GNOCACHE is enabled. NULL disables this.
+#ifndef GPURGESECRET
+#define GPURGESECRET NULL
+#endif
+
+// Set this to a number of seconds to trust that a cached file is current
+//  for that long after the base server last said so, instead of asking it
+//  with a HEAD request every time. Only do this if the base server tells us
+//  when files change (see GPURGESECRET), or if it's okay to serve a stale
+//  copy for up to this long. 0 asks the base server every time.
+#ifndef GREVALIDATETTL
+#define GREVALIDATETTL 0
+#endif
+
+// The base server can also ask us to pull a file into the cache before any
+//  client wants it ("notify_offload_purge.pl --prefetch"), so the first
+//  wave of downloads after a release doesn't all wait on the base server.
+//  Requests are signed like purges, with this secret. NULL disables this.
+#ifndef GPREFETCHSECRET
+#define GPREFETCHSECRET GPURGESECRET
+#endif
+
+// Prefetch requests for files smaller than this many bytes are ignored;
+//  those are cheap enough to fetch when someone actually asks for them.
+#ifndef GPREFETCHMINSIZE
+#define GPREFETCHMINSIZE 0
+#endif
+
+// Each prefetch pulls from the base server at no more than this many bytes
+//  per second, and no more than GPREFETCHMAXFILLS of them run at once, so
+//  warming the cache doesn't starve real downloads. If someone asks for the
+//  file while it's being prefetched, the rest of it comes as fast as it can,
+//  since they're waiting on it. Extra prefetch requests get a "503" and
+//  should be retried later. 0 means no rate limit.
+#ifndef GPREFETCHRATE
+#define GPREFETCHRATE (10 * 1024 * 1024)
+#endif
+
+#ifndef GPREFETCHMAXFILLS
+#define GPREFETCHMAXFILLS 2
+#endif
+
+// Set this to a list of other offload servers for the same base server, as
+//  "host:port" (or "[ipv6addr]:port") strings, like this:
+//     "10.0.0.2:80", "10.0.0.3:80"
+// On a cache miss, we ask each of them for the file before pulling it from
+//  the base server. Peers only answer with a complete cached copy of the
+//  exact version the base server just told us about, so this never adds
+//  load to the base server or serves anything stale. Don't list this server
+//  itself. We only answer peer requests from the servers listed here (by
+//  address, looking up names), so every peer should list all the others.
+//  This is ignored if GNOCACHE is enabled. NULL disables this.
+#ifndef GPEERS
+#define GPEERS NULL
+#endif
+
+// Give up on a peer if it hasn't answered in this many milliseconds. Every
+//  peer that doesn't have the file adds up to this much to a cache miss.
+#ifndef GPEERTIMEOUTMS
+#define GPEERTIMEOUTMS 250
+#endif
+
+// Set this to a list of parent offload servers, in the same format as
+//  GPEERS, to run this server as an edge in a cache hierarchy: we fill our
+//  cache from the first parent that's up, and only go to the base server if
+//  none of them are. Parents are just offload servers themselves (listing
+//  their own parents, or none), so a regional tier can absorb most of the
+//  traffic to the base server. Tokens from mod_offload (see GTOKENSECRET)
+//  are passed along, and parents with GREVALIDATETTL or GTOKENSECRET set
+//  can answer our HEAD requests from their caches, too. NULL disables this.
+#ifndef GPARENTS
+#define GPARENTS NULL
+#endif
+
+// Move on to the next parent if we can't connect to one within this many
+//  milliseconds. Parents that answer with a 5xx error, a 403 or a 429 are
+//  skipped, too, as are cache fills that aren't a 200 with the ETag and
+//  Content-Length the HEAD request promised.
+#ifndef GPARENTTIMEOUTMS
+#define GPARENTTIMEOUTMS 1000
+#endif
+
+// If other offload servers list this one in their GPARENTS, list them here,
+//  as "host" or "host:port" strings like GPEERS (the port is ignored). Each
+//  of them fetches files for a lot of clients, so their requests aren't held
+//  to GMAXDUPEDOWNLOADS, GMAXCLIENTCONNS, GCLIENTRATE or GPACINGRATE; they
+//  still count against GEGRESSRATE. Names get looked up on every download,
+//  so use addresses if you can. NULL disables this.
+#ifndef GCHILDREN
+#define GCHILDREN NULL
+#endif
+
+// Set this to offload several base servers from one daemon, instead of
+//  building and running a copy for each. It's a list of space-separated
+//  "clienthost=baseserver[@address][:port]" entries, where clienthost is the
+//  name clients use to reach us for that site, and address is like
+//  GBASESERVERIP (the default is to look up baseserver):
+//     "dl.example.com=example.com dl.example.org=example.org@10.0.0.5:8080"
+// We pick the base server by the request's Host header, and each one's
+//  files are cached in a subdirectory of GOFFLOADDIR named after it.
+//  Requests for any other host go to GBASESERVER, cached in GOFFLOADDIR
+//  itself. Point mod_offload on each base server at its clienthost.
+//  NULL disables this.
+#ifndef GORIGINS
+#define GORIGINS NULL
+#endif
+
+// Set this to the most bytes the cache may hold, for all of GORIGINS put
+//  together. Every GCACHESCANSECS seconds, the daemon deletes the files
+//  that have gone longest without a request until it's 10% under this,
+//  and any urlindex files left pointing at them.
+//  This only works if GLISTENPORT is set; otherwise, clean up with
+//  cleanup_offload_cache.pl. 0 means there's no limit.
+#ifndef GCACHEMAXBYTES
+#define GCACHEMAXBYTES 0
+#endif
+
+#ifndef GCACHESCANSECS
+#define GCACHESCANSECS 60
+#endif
+
 // Set to 1 to try to change title in "ps" listings. It becomes:
 //   "offload: GET /my/url.whatever" (or whatever).
 #ifndef GSETPROCTITLE